@@ -0,0 +1,41 @@
+-- Throughput of array arguments.
+--
+-- Load definitions.sql first.  Each row passes a thousand arrays of a
+-- thousand elements to JavaScript, with plv8.typed_arrays off and then on
+-- for float8[].  Compare the per-element times (in nanoseconds) between
+-- builds.
+
+create or replace function js_length(a anyarray) returns int as $$
+	return a.length;
+$$ language plv8 immutable strict;
+
+create temp table bench_arrays as
+	select array_agg(i) as i, array_agg(i::float8) as f,
+		array_agg(i % 2 = 0) as b, array_agg('element ' || i) as t
+	from generate_series(1, 1000) i, generate_series(1, 1000) r
+	group by r;
+
+-- warm up the context and compile the function
+select js_length('{1}'::int[]);
+
+select 'int4[]' as arg,
+	plbench('select sum(js_length(i)) from bench_arrays', 5)
+	/ 5000000 * 1000000 as nsec_per_element
+union all
+select 'bool[]',
+	plbench('select sum(js_length(b)) from bench_arrays', 5)
+	/ 5000000 * 1000000
+union all
+select 'text[]',
+	plbench('select sum(js_length(t)) from bench_arrays', 5)
+	/ 5000000 * 1000000
+union all
+select 'float8[]',
+	plbench('select sum(js_length(f)) from bench_arrays', 5)
+	/ 5000000 * 1000000;
+
+set plv8.typed_arrays = on;
+select 'float8[] typed' as arg,
+	plbench('select sum(js_length(f)) from bench_arrays', 5)
+	/ 5000000 * 1000000 as nsec_per_element;
+reset plv8.typed_arrays;
@@ -0,0 +1,53 @@
+-- Per-call overhead of plv8 functions.
+--
+-- Load definitions.sql first.  js_add never touches the database and
+-- should not pay for an SPI connection; js_add_spi runs a query on every
+-- call and shows the cost of connecting to SPI.  js_add_stmt runs one
+-- statement per call and shows the cost of setting up a call site.
+-- js_add_many_users is js_add again with the contexts of 100 other users
+-- in the backend, and should cost the same.  Compare the per-call times
+-- (in microseconds) between builds.
+
+create or replace function js_add_spi(a int, b int) returns int as $$
+	return plv8.execute('select $1 + $2 as r', [a, b])[0].r;
+$$ language plv8 immutable strict;
+
+-- warm up the context and compile the functions
+select js_add(1, 2), js_add_spi(1, 2);
+
+select 'js_add' as func,
+	plbench('select sum(js_add(i, i)) from generate_series(1, 1000000) i', 5)
+	/ 5000000 * 1000 as usec_per_call
+union all
+select 'js_add_spi',
+	plbench('select sum(js_add_spi(i, i)) from generate_series(1, 100000) i', 5)
+	/ 500000 * 1000
+union all
+select 'js_add_stmt',
+	plbench('select js_add(1, 2)', 100000)
+	/ 100000 * 1000;
+
+-- create a context for each of many users
+do $$
+begin
+	for i in 1 .. 100 loop
+		execute format('create role plv8_bench_%s', i);
+		execute format('set role plv8_bench_%s', i);
+		perform js_add(1, 2);
+		reset role;
+	end loop;
+end
+$$;
+
+select 'js_add_many_users' as func,
+	plbench('select sum(js_add(i, i)) from generate_series(1, 1000000) i', 5)
+	/ 5000000 * 1000 as usec_per_call;
+
+select plv8_reset();
+do $$
+begin
+	for i in 1 .. 100 loop
+		execute format('drop role plv8_bench_%s', i);
+	end loop;
+end
+$$;
@@ -0,0 +1,29 @@
+-- Cost of compiling a function on its first call.
+--
+-- Load definitions.sql first.  js_big has a body of a few thousand lines;
+-- every call after plv8_reset() compiles it again.  The js_add row is the
+-- cost of creating the context alone and should be subtracted from the
+-- js_big row.  Compare the per-compile times (in milliseconds) between
+-- builds.
+
+do $do$
+declare
+	body text := '';
+begin
+	for i in 1 .. 5000 loop
+		body := body || format(E'\tvar v%s = a + %s;\n', i, i);
+	end loop;
+	execute format($f$
+		create or replace function js_big(a int) returns int as $$
+		%s
+		return v5000;
+		$$ language plv8 immutable strict;
+	$f$, body);
+end;
+$do$;
+
+select 'js_add' as func,
+	plbench('select plv8_reset(), js_add(1, 2)', 100) / 100 as msec_per_compile
+union all
+select 'js_big',
+	plbench('select plv8_reset(), js_big(1)', 100) / 100;
@@ -0,0 +1,17 @@
+-- Resident memory a connection gains from its first plv8 call.
+--
+-- Load definitions.sql first, and run this file as a superuser in a new
+-- connection for each setting to compare, e.g.
+--
+--   psql -f bench/footprint.sql
+--   PGOPTIONS='-c plv8.memory_limit=16 -c plv8.semi_space_size=512kB -c plv8.jitless=on' psql -f bench/footprint.sql
+--
+-- Compare the plv8_kb column (in kilobytes) between settings and builds.
+
+create or replace function rss_kb() returns bigint as $$
+	select substring(pg_read_file('/proc/self/status') from 'VmRSS:\s+(\d+)')::bigint;
+$$ language sql;
+
+select rss_kb() as before_kb \gset
+select js_add(1, 2);
+select rss_kb() - :before_kb as plv8_kb, rss_kb() as rss_kb;
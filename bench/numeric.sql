@@ -0,0 +1,34 @@
+-- Throughput of NUMERIC arguments in each plv8.numeric_conversion mode.
+--
+-- Load definitions.sql first.  Each row converts a million NUMERIC values
+-- with two fractional digits to JavaScript and back.  Compare the per-value
+-- times (in microseconds) between modes and builds.
+
+create or replace function js_numeric(n numeric) returns numeric as $$
+	return n;
+$$ language plv8 immutable strict;
+
+create temp table bench_numeric as
+	select (random() * 1000000)::numeric(12, 2) as n
+	from generate_series(1, 1000000);
+
+-- warm up the context and compile the function
+select js_numeric(1.5);
+
+set plv8.numeric_conversion = 'float';
+select 'float' as mode,
+	plbench('select sum(js_numeric(n)) from bench_numeric', 5)
+	/ 5000000 * 1000 as usec_per_value;
+set plv8.numeric_conversion = 'exact';
+select 'exact',
+	plbench('select sum(js_numeric(n)) from bench_numeric', 5)
+	/ 5000000 * 1000;
+set plv8.numeric_conversion = 'bigint';
+select 'bigint',
+	plbench('select sum(js_numeric(n)) from bench_numeric', 5)
+	/ 5000000 * 1000;
+set plv8.numeric_conversion = 'string';
+select 'string',
+	plbench('select sum(js_numeric(n)) from bench_numeric', 5)
+	/ 5000000 * 1000;
+reset plv8.numeric_conversion;
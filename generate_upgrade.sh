@@ -3,7 +3,7 @@
 # version is the first argument, passed in from Makefile
 VERSION=$1
 
-older_versions=(1.5.0 1.5.1 1.5.2 1.5.3 1.5.4 1.5.5 1.5.6 1.5.7 2.0.0 2.0.1 2.0.3 2.1.0 2.1.2 2.3.0 2.3.1 2.3.2 2.3.3 2.3.4 2.3.5 2.3.6 2.3.7 2.3.8 2.3.9 2.3.10 2.3.11 2.3.12 2.3.13 2.3.14 2.3.15 3.0.0 3.0.1 3.1.0 3.1.1 3.1.2 3.1.3 3.1.4 3.1.5 3.1.6 3.1.7 3.1.8 3.2.0 3.2.1)
+older_versions=(1.5.0 1.5.1 1.5.2 1.5.3 1.5.4 1.5.5 1.5.6 1.5.7 2.0.0 2.0.1 2.0.3 2.1.0 2.1.2 2.3.0 2.3.1 2.3.2 2.3.3 2.3.4 2.3.5 2.3.6 2.3.7 2.3.8 2.3.9 2.3.10 2.3.11 2.3.12 2.3.13 2.3.14 2.3.15 3.0.0 3.0.1 3.1.0 3.1.1 3.1.2 3.1.3 3.1.4 3.1.5 3.1.6 3.1.7 3.1.8 3.2.0 3.2.1 3.2.2)
 
 for i in ${older_versions[@]}; do
 cat > upgrade/plv8--${i}--$VERSION.sql << EOF
@@ -19,5 +19,13 @@ CREATE OR REPLACE FUNCTION plv8_inline_handler(internal) RETURNS void
  AS 'MODULE_PATHNAME' LANGUAGE C;
 CREATE OR REPLACE FUNCTION plv8_call_validator(oid) RETURNS void
  AS 'MODULE_PATHNAME' LANGUAGE C;
+DROP FUNCTION IF EXISTS plv8_reset();
+CREATE OR REPLACE FUNCTION plv8_reset(keep_isolate boolean DEFAULT false) RETURNS void
+ AS 'MODULE_PATHNAME' LANGUAGE C;
+CREATE OR REPLACE FUNCTION plv8_build_snapshot(role regrole DEFAULT NULL) RETURNS void
+ AS 'MODULE_PATHNAME' LANGUAGE C;
+REVOKE ALL ON FUNCTION plv8_build_snapshot(regrole) FROM PUBLIC;
+CREATE OR REPLACE FUNCTION plv8_prewarm(schema_pattern text DEFAULT '%', role regrole DEFAULT NULL)
+ RETURNS JSON AS 'MODULE_PATHNAME' LANGUAGE C;
 EOF
 done
@@ -25,14 +25,22 @@ extern "C" {
 #include "commands/trigger.h"
 #include "executor/spi.h"
 #include "funcapi.h"
+#include "lib/ilist.h"
 #include "miscadmin.h"
+#include "portability/instr_time.h"
+#include "utils/acl.h"
 #include "utils/builtins.h"
 #include "utils/guc.h"
 #include "utils/guc_tables.h"
+#include "utils/inval.h"
 #include "utils/memutils.h"
 #include "utils/lsyscache.h"
 #include "utils/rel.h"
+#if PG_VERSION_NUM >= 110000
+#include "utils/regproc.h"
+#endif
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
 
 #if PG_VERSION_NUM >= 120000
 #include "catalog/pg_database.h"
@@ -40,17 +48,28 @@ extern "C" {
 
 #if PG_VERSION_NUM >= 130000
 #include "common/hashfn.h"
+#elif PG_VERSION_NUM >= 110000
+#include "utils/hashutils.h"
+#else
+#include "access/hash.h"
 #endif
+#include "storage/fd.h"
+#include "storage/proc.h"
 
-#include <signal.h>
-
-#ifdef EXECUTION_TIMEOUT
-#ifdef _MSC_VER
-#include <windows.h>
+#include <sys/stat.h>
+#ifdef WIN32
+#include <sys/utime.h>
 #else
-#include <unistd.h>
+#include <utime.h>
+#endif
+#ifndef WIN32
+#include <sys/mman.h>
 #endif
+
+#ifndef WIN32
+#include <pthread.h>
 #endif
+#include <signal.h>
 
 PG_MODULE_MAGIC;
 
@@ -58,11 +77,15 @@ PGDLLEXPORT Datum	plv8_call_handler(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum	plv8_call_validator(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum	plv8_reset(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum	plv8_info(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum	plv8_build_snapshot(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum	plv8_prewarm(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(plv8_call_handler);
 PG_FUNCTION_INFO_V1(plv8_call_validator);
 PG_FUNCTION_INFO_V1(plv8_reset);
 PG_FUNCTION_INFO_V1(plv8_info);
+PG_FUNCTION_INFO_V1(plv8_build_snapshot);
+PG_FUNCTION_INFO_V1(plv8_prewarm);
 
 
 PGDLLEXPORT void _PG_init(void);
@@ -74,19 +97,33 @@ PG_FUNCTION_INFO_V1(plv8_inline_handler);
 #endif
 } // extern "C"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
 using namespace v8;
 
+/*
+ * A function compiled for one user.  The same function called by another
+ * user is compiled again in that user's isolate and cached separately.
+ */
 typedef struct plv8_proc_cache
 {
 	Oid						fn_oid;
+	Oid						user_id;
+	dlist_node				lru_node;	/* in plv8_proc_lru or evicted */
 
 	Persistent<Function>	function;
 	char					proname[NAMEDATALEN];
 	char				   *prosrc;
+	struct plv8_exec_env   *xenv;		/* kept across transactions */
+	struct plv8_proc	   *procs;		/* resolved call descriptors */
 
-	TransactionId			fn_xmin;
-	ItemPointerData			fn_tid;
-	Oid						user_id;
+	bool					valid;		/* cleared when pg_proc row changes */
 
 	int						nargs;
 	bool					retset;		/* true if SRF */
@@ -99,9 +136,12 @@ size_t plv8_memory_limit = 0;
 size_t plv8_last_heap_size = 0;
 
 /*
- * The function and context are created at the first invocation.  Their
- * lifetime is same as plv8_proc, but they are not palloc'ed memory,
- * so we need to clear them at the end of transaction.
+ * The receiver and context are created at the first invocation.  A
+ * function's exec env lives in its plv8_proc_cache entry and is kept until
+ * the function is invalidated or its plv8 context is reset, so whatever a
+ * function stores on `this` survives across transactions.  Exec envs of
+ * inline code blocks are allocated in TopTransactionContext and linked to
+ * exec_env_head, and their handles are cleared at the end of transaction.
  */
 typedef struct plv8_exec_env
 {
@@ -113,20 +153,73 @@ typedef struct plv8_exec_env
 } plv8_exec_env;
 
 /*
- * We cannot cache plv8_type inter executions because it has FmgrInfo fields.
- * So, we cache rettype and argtype in fn_extra only during one execution.
+ * A call descriptor holds the argument and return types of a function,
+ * resolved for one set of actual polymorphic types.  Descriptors live in
+ * their own memory context, hang off the function's plv8_proc_cache entry
+ * and are shared by all call sites across statements.  When the function
+ * or one of the types is invalidated, they are moved to dead_procs and
+ * freed at the end of transaction, once no running call uses them.
  */
 typedef struct plv8_proc
 {
 	plv8_proc_cache		   *cache;
-	plv8_exec_env		   *xenv;
-	TypeFuncClass			functypclass;			/* For SRF */
+	struct plv8_proc	   *next;
+	MemoryContext			mcxt;		/* NULL if not cached */
+	int						use_count;	/* running calls */
+	bool					stale;		/* one of the types changed */
+	Oid						rettypid;
+	Oid						argtypids[FUNC_MAX_ARGS];
 	plv8_type				rettype;
 	plv8_type				argtypes[FUNC_MAX_ARGS];
 } plv8_proc;
 
+/*
+ * What a call site keeps in fn_extra, in fn_mcxt.  An FmgrInfo can outlive
+ * the descriptor it last used, so the descriptor is only looked at while
+ * no descriptor has been retired since; plv8_proc_generation counts them.
+ */
+typedef struct plv8_call_site
+{
+	plv8_proc			   *proc;
+	uint64					generation;
+} plv8_call_site;
+
+typedef struct plv8_proc_key
+{
+	Oid						fn_oid;
+	Oid						user_id;
+} plv8_proc_key;
+
+typedef struct plv8_proc_cache_entry
+{
+	plv8_proc_key			key;
+	plv8_proc_cache		   *cache;
+} plv8_proc_cache_entry;
+
 static HTAB *plv8_proc_cache_hash = NULL;
 
+/*
+ * All cached functions, most recently used first.  Evicted ones may still
+ * be referenced by running calls, and are freed at the end of transaction.
+ */
+static dlist_head plv8_proc_lru = DLIST_STATIC_INIT(plv8_proc_lru);
+static dlist_head plv8_proc_evicted = DLIST_STATIC_INIT(plv8_proc_evicted);
+
+static plv8_proc		   *dead_procs = NULL;
+static uint64				plv8_proc_generation = 0;
+
+/*
+ * Keeps a call descriptor from being freed while a call uses it.
+ */
+class ProcInUse
+{
+private:
+	plv8_proc	   *m_proc;
+public:
+	ProcInUse(plv8_proc *proc) : m_proc(proc) { m_proc->use_count++; }
+	~ProcInUse() { m_proc->use_count--; }
+};
+
 static plv8_exec_env		   *exec_env_head = NULL;
 
 static void killPlv8Context(plv8_context *ctx);
@@ -138,13 +231,16 @@ static void killPlv8Context(plv8_context *ctx);
 static plv8_proc *plv8_get_proc(Oid fn_oid, FunctionCallInfo fcinfo,
 		bool validate, char ***argnames) throw();
 static void plv8_xact_cb(XactEvent event, void *arg);
+static void plv8_syscache_cb(Datum arg, int cacheid, uint32 hashvalue);
+static void plv8_free_dead_procs();
+static void plv8_initialize_v8();
 
 /*
  * CamelCaseFunctions are C++ functions.
  * They could raise errors with C++ throw statements, or never throw exceptions.
  */
 static plv8_exec_env *CreateExecEnv(Handle<Function> function, plv8_context *context);
-static plv8_exec_env *CreateExecEnv(Persistent<Function>& function, plv8_context *context);
+static plv8_exec_env *GetExecEnv(plv8_proc_cache *cache, plv8_context *context);
 static plv8_proc *Compile(Oid fn_oid, FunctionCallInfo fcinfo,
 					bool validate, bool is_trigger);
 static Local<Function> CompileFunction(plv8_context *global_context,
@@ -158,7 +254,18 @@ static Datum CallSRFunction(PG_FUNCTION_ARGS, plv8_exec_env *xenv,
 static Datum CallTrigger(PG_FUNCTION_ARGS, plv8_exec_env *xenv);
 static plv8_context *GetPlv8Context();
 static Local<ObjectTemplate> GetGlobalObjectTemplate(Isolate *isolate);
-static void CreateIsolate(plv8_context *context);
+static void CreateIsolate(plv8_context *context, const StartupData *snapshot);
+static StartupData BuildSnapshot();
+static uint64 plv8_hash_bytes(const char *data, int len, uint64 seed);
+static char *plv8_code_cache_read(const char *path, int *len);
+static void ResetCallState();
+static void WatchdogSync();
+static void EvictPlv8Contexts(TimestampTz now, bool make_room);
+static void InitGlobalContext(plv8_context *context);
+static void IdleNotification(TimestampTz xact_start);
+
+/* A GUC to limit the number of compiled functions kept per backend */
+static int plv8_function_cache_size = 1024;
 
 /* A GUC to specify a custom start up function to call */
 static char *plv8_start_proc = NULL;
@@ -166,9 +273,80 @@ static char *plv8_start_proc = NULL;
 /* A GUC to specify V8 flags (e.g. --es_staging) */
 static char *plv8_v8_flags = NULL;
 
+/* A GUC to specify how NUMERIC values are converted to JavaScript */
+int plv8_numeric_conversion = PLV8_NUMERIC_FLOAT;
+bool plv8_typed_arrays = false;
+
+static const struct config_enum_entry plv8_numeric_conversion_options[] = {
+	{"float", PLV8_NUMERIC_FLOAT, false},
+	{"exact", PLV8_NUMERIC_EXACT, false},
+	{"bigint", PLV8_NUMERIC_BIGINT, false},
+	{"string", PLV8_NUMERIC_STRING, false},
+	{NULL, 0, false}
+};
+
+/* A GUC to run V8 without generating machine code at runtime */
+static bool plv8_jitless = false;
+
+/* A GUC to specify the size of an isolate's semi-space, in kB */
+static int plv8_semi_space_size = 0;
+
 /* A GUC to specify the ICU data directory */
 static char *plv8_icu_data = NULL;
 
+/* A GUC to persist V8 code cache data of compiled functions */
+static bool plv8_code_cache = false;
+
+/* A GUC to cap the size of the code cache directory, in kB */
+static int plv8_code_cache_size = 65536;
+
+/* A GUC to specify the schemas whose functions are compiled with a new context */
+static char *plv8_prewarm_pattern = NULL;
+
+/* A GUC to limit the number of contexts kept per backend */
+static int plv8_max_contexts = 0;
+
+/* A GUC to specify the idle time after which a context is disposed, in seconds */
+static int plv8_context_idle_timeout = 0;
+
+/* A GUC to specify the time given to garbage collection at transaction end, in ms */
+static int plv8_idle_gc_time = 0;
+
+/* A GUC to specify the idle time after which a context's heap is trimmed, in seconds */
+static int plv8_idle_trim_timeout = 0;
+
+#define PLV8_CODE_CACHE_DIR		"plv8/code_cache"
+
+/*
+ * Startup snapshot built by plv8_build_snapshot(), one per database and role,
+ * as it holds whatever the start up procedure saw as that role.  The header
+ * records what the snapshot was built from, so that a stale one, or one of
+ * another role, is ignored rather than restored.
+ */
+#define PLV8_SNAPSHOT_DIR		"plv8"
+#define PLV8_SNAPSHOT_MAGIC		"PLV8SNP2"
+
+typedef struct plv8_snapshot_header
+{
+	char		magic[8];
+	char		v8_version[32];
+	char		plv8_version[16];
+	uint64		v8_flags_hash;
+	uint64		start_proc_hash;
+	uint64		prosrc_hash;
+	Oid			user_id;
+	uint32		blob_size;
+} plv8_snapshot_header;
+
+typedef struct plv8_snapshot_entry
+{
+	plv8_snapshot_header	info;
+	StartupData				blob;
+} plv8_snapshot_entry;
+
+/* Loaded once per role and backend; isolates booted from one keep referring to it */
+static std::unordered_map<Oid, plv8_snapshot_entry> plv8_snapshots;
+
 /* A GUC to specify the remote debugger port */
 static int plv8_debugger_port;
 
@@ -177,12 +355,36 @@ static int plv8_execution_timeout = 300;
 #endif
 
 static std::unique_ptr<v8::Platform> v8_platform = NULL;
+static bool v8_initialized = false;
+
+/*
+ * SPI connection state of the innermost DoCall.  We connect to SPI lazily,
+ * on the first use of a builtin that touches the database, so that purely
+ * computational calls don't pay for SPI_connect/SPI_finish.
+ */
+typedef struct plv8_spi_state
+{
+	bool		connected;
+	bool		nonatomic;
+} plv8_spi_state;
+
+static plv8_spi_state *current_spi = NULL;
 
 /*
- * We use vector instead of hash since the size of this array
- * is expected to be short in most cases.
+ * The contexts in the order they were created, and the same contexts by
+ * user id.  The context looked up last is kept aside, as consecutive calls
+ * are almost always made by the same user.
  */
 static std::vector<plv8_context *> ContextVector;
+static std::unordered_map<Oid, plv8_context *> ContextMap;
+static plv8_context *last_context = nullptr;
+
+/*
+ * Users whose context was evicted, with the number of times their context
+ * was created again since, and the number of evictions in this backend.
+ */
+static std::unordered_map<Oid, uint64> evicted_users;
+static uint64 plv8_context_evictions = 0;
 
 #ifdef ENABLE_DEBUGGER_SUPPORT
 v8::Persistent<v8::Context> debug_message_context;
@@ -210,6 +412,8 @@ void OOMErrorHandler(const char* location, const v8::OOMDetails &) {
 	isolate->TerminateExecution();
 	// set it to kill the user context and isolate
 	current_context->is_dead = true;
+	// we are about to longjmp out of the running calls
+	ResetCallState();
 	elog(ERROR, "Out of memory error");
 }
 
@@ -306,14 +510,29 @@ void HandleUnhandledPromiseRejections() {
 }
 
 static void
-CreateIsolate(plv8_context *context) {
+CreateIsolate(plv8_context *context, const StartupData *snapshot) {
 	Isolate *isolate;
 	Isolate::CreateParams params;
 	params.array_buffer_allocator = new ArrayAllocator(plv8_memory_limit * 1_MB);
+	/*
+	 * V8 refers to the blob for the lifetime of the isolate, to restore
+	 * more contexts from it.  Keep our own copy of the descriptor, as a
+	 * rebuilt snapshot replaces the loaded one; the data it points to is
+	 * never unmapped.
+	 */
+	if (snapshot != NULL)
+	{
+		context->snapshot = *snapshot;
+		params.snapshot_blob = &context->snapshot;
+		params.external_references = plv8_external_references;
+	}
 	//params.array_buffer_allocator =
   //    v8::ArrayBuffer::Allocator::NewDefaultAllocator();
 	ResourceConstraints rc;
 	rc.ConfigureDefaults(plv8_memory_limit * 1_MB * 2, plv8_memory_limit * 1_MB * 2);
+	/* The young generation is two semi-spaces and a large object space */
+	if (plv8_semi_space_size > 0)
+		rc.set_max_young_generation_size_in_bytes((size_t) plv8_semi_space_size * 1024 * 3);
 	params.constraints = rc;
 	isolate = Isolate::New(params);
 	isolate->SetOOMErrorHandler(OOMErrorHandler);
@@ -329,11 +548,12 @@ _PG_init(void)
 {
 	HASHCTL    hash_ctl = { 0 };
 
-	hash_ctl.keysize = sizeof(Oid);
-	hash_ctl.entrysize = sizeof(plv8_proc_cache);
-	hash_ctl.hash = oid_hash;
+	hash_ctl.keysize = sizeof(plv8_proc_key);
+	hash_ctl.entrysize = sizeof(plv8_proc_cache_entry);
 	plv8_proc_cache_hash = hash_create("PLv8 Procedures", 32,
-									   &hash_ctl, HASH_ELEM | HASH_FUNCTION);
+									   &hash_ctl, HASH_ELEM | HASH_BLOBS);
+	CacheRegisterSyscacheCallback(PROCOID, plv8_syscache_cb, (Datum) 0);
+	CacheRegisterSyscacheCallback(TYPEOID, plv8_syscache_cb, (Datum) 0);
 
     config_generic *guc_value;
 
@@ -445,7 +665,7 @@ _PG_init(void)
                                 gettext_noop("Per-isolate memory limit in MBytes"),
                                 gettext_noop("The default value is 256 MB"),
                                 (int *) &plv8_memory_limit,
-                                256, 256, 3096, // hardcoded v8 limits for isolates
+                                256, 16, 3096, // hardcoded v8 limits for isolates
                                 PGC_SUSET, 0,
 #if PG_VERSION_NUM >= 90100
                                 NULL,
@@ -455,10 +675,256 @@ _PG_init(void)
     }
 #undef MEMORY_LIMIT_VAR
 
+#define NUMERIC_CONVERSION_VAR "plv8.numeric_conversion"
+    guc_value = plv8_find_option(NUMERIC_CONVERSION_VAR);
+    if (guc_value != NULL) {
+        plv8_numeric_conversion = plv8_enum_option(guc_value);
+    } else {
+        DefineCustomEnumVariable(NUMERIC_CONVERSION_VAR,
+                                 gettext_noop("How NUMERIC values are converted to JavaScript."),
+                                 gettext_noop("float converts them to numbers, which may lose precision; "
+                                              "exact to numbers when that is lossless, else to strings; "
+                                              "bigint to BigInt when they have no fractional digits, else to strings; "
+                                              "string to strings."),
+                                 &plv8_numeric_conversion,
+                                 PLV8_NUMERIC_FLOAT,
+                                 plv8_numeric_conversion_options,
+                                 PGC_USERSET, 0,
+#if PG_VERSION_NUM >= 90100
+                                 NULL,
+#endif
+                                 NULL,
+                                 NULL);
+    }
+#undef NUMERIC_CONVERSION_VAR
+
+#define TYPED_ARRAYS_VAR "plv8.typed_arrays"
+    guc_value = plv8_find_option(TYPED_ARRAYS_VAR);
+    if (guc_value != NULL) {
+        plv8_typed_arrays = plv8_bool_option(guc_value);
+    } else {
+        DefineCustomBoolVariable(TYPED_ARRAYS_VAR,
+                                 gettext_noop("Convert arrays of fixed-width numbers and booleans to typed arrays."),
+                                 gettext_noop("Arrays with NULL elements are still converted to regular arrays."),
+                                 &plv8_typed_arrays,
+                                 false,
+                                 PGC_USERSET, 0,
+#if PG_VERSION_NUM >= 90100
+                                 NULL,
+#endif
+                                 NULL,
+                                 NULL);
+    }
+#undef TYPED_ARRAYS_VAR
+
+#define SEMI_SPACE_SIZE_VAR "plv8.semi_space_size"
+    guc_value = plv8_find_option(SEMI_SPACE_SIZE_VAR);
+    if (guc_value != NULL) {
+        plv8_semi_space_size = plv8_int_option(guc_value);
+    } else {
+        DefineCustomIntVariable(SEMI_SPACE_SIZE_VAR,
+                                gettext_noop("Per-isolate size of a semi-space of the young generation."),
+                                gettext_noop("0 lets V8 size it from plv8.memory_limit."),
+                                &plv8_semi_space_size,
+                                0, 0, 64 * 1024,
+                                PGC_SUSET, GUC_UNIT_KB,
+#if PG_VERSION_NUM >= 90100
+                                NULL,
+#endif
+                                NULL,
+                                NULL);
+    }
+#undef SEMI_SPACE_SIZE_VAR
+
+#define JITLESS_VAR "plv8.jitless"
+    guc_value = plv8_find_option(JITLESS_VAR);
+    if (guc_value != NULL) {
+        plv8_jitless = plv8_bool_option(guc_value);
+    } else {
+        DefineCustomBoolVariable(JITLESS_VAR,
+                                 gettext_noop("Run V8 without generating machine code at runtime."),
+                                 gettext_noop("Takes effect when PLV8 is loaded by a connection."),
+                                 &plv8_jitless,
+                                 false,
+                                 PGC_SUSET, 0,
+#if PG_VERSION_NUM >= 90100
+                                 NULL,
+#endif
+                                 NULL,
+                                 NULL);
+    }
+#undef JITLESS_VAR
+
+#define CODE_CACHE_VAR "plv8.code_cache"
+    guc_value = plv8_find_option(CODE_CACHE_VAR);
+    if (guc_value != NULL) {
+        plv8_code_cache = plv8_bool_option(guc_value);
+    } else {
+        DefineCustomBoolVariable(CODE_CACHE_VAR,
+                                 gettext_noop("Persist V8 code cache data of compiled functions."),
+                                 gettext_noop("Code cache files are kept in the plv8/code_cache "
+                                              "subdirectory of the data directory."),
+                                 &plv8_code_cache,
+                                 false,
+                                 PGC_SUSET, 0,
+#if PG_VERSION_NUM >= 90100
+                                 NULL,
+#endif
+                                 NULL,
+                                 NULL);
+    }
+#undef CODE_CACHE_VAR
+
+#define CODE_CACHE_SIZE_VAR "plv8.code_cache_size"
+    guc_value = plv8_find_option(CODE_CACHE_SIZE_VAR);
+    if (guc_value != NULL) {
+        plv8_code_cache_size = plv8_int_option(guc_value);
+    } else {
+        DefineCustomIntVariable(CODE_CACHE_SIZE_VAR,
+                                gettext_noop("Maximum size of the code cache directory."),
+                                gettext_noop("The least recently used files are removed beyond it.  "
+                                             "0 means no limit."),
+                                &plv8_code_cache_size,
+                                65536, 0, INT_MAX,
+                                PGC_SUSET, GUC_UNIT_KB,
+#if PG_VERSION_NUM >= 90100
+                                NULL,
+#endif
+                                NULL,
+                                NULL);
+    }
+#undef CODE_CACHE_SIZE_VAR
+
+#define PREWARM_VAR "plv8.prewarm"
+    guc_value = plv8_find_option(PREWARM_VAR);
+    if (guc_value != NULL) {
+        plv8_prewarm_pattern = plv8_string_option(guc_value);
+    } else {
+        DefineCustomStringVariable(PREWARM_VAR,
+                                   gettext_noop("LIKE pattern of the schemas whose PLV8 functions are compiled when PLV8 is first used."),
+                                   NULL,
+                                   &plv8_prewarm_pattern,
+                                   NULL,
+                                   PGC_USERSET, 0,
+#if PG_VERSION_NUM >= 90100
+                                   NULL,
+#endif
+                                   NULL,
+                                   NULL);
+    }
+#undef PREWARM_VAR
+
+#define FUNCTION_CACHE_SIZE_VAR "plv8.function_cache_size"
+    guc_value = plv8_find_option(FUNCTION_CACHE_SIZE_VAR);
+    if (guc_value != NULL) {
+        plv8_function_cache_size = plv8_int_option(guc_value);
+    } else {
+        DefineCustomIntVariable(FUNCTION_CACHE_SIZE_VAR,
+                                gettext_noop("Maximum number of compiled functions kept per backend."),
+                                gettext_noop("A function is compiled once per calling user.  "
+                                             "The least recently used ones are dropped beyond this limit."),
+                                &plv8_function_cache_size,
+                                1024, 1, INT_MAX,
+                                PGC_USERSET, 0,
+#if PG_VERSION_NUM >= 90100
+                                NULL,
+#endif
+                                NULL,
+                                NULL);
+    }
+#undef FUNCTION_CACHE_SIZE_VAR
+
+#define MAX_CONTEXTS_VAR "plv8.max_contexts"
+    guc_value = plv8_find_option(MAX_CONTEXTS_VAR);
+    if (guc_value != NULL) {
+        plv8_max_contexts = plv8_int_option(guc_value);
+    } else {
+        DefineCustomIntVariable(MAX_CONTEXTS_VAR,
+                                gettext_noop("Maximum number of per-user contexts kept per backend."),
+                                gettext_noop("The least recently used context is disposed of to make room "
+                                             "for a new one.  0 means no limit."),
+                                &plv8_max_contexts,
+                                0, 0, INT_MAX,
+                                PGC_SUSET, 0,
+#if PG_VERSION_NUM >= 90100
+                                NULL,
+#endif
+                                NULL,
+                                NULL);
+    }
+#undef MAX_CONTEXTS_VAR
+
+#define CONTEXT_IDLE_TIMEOUT_VAR "plv8.context_idle_timeout"
+    guc_value = plv8_find_option(CONTEXT_IDLE_TIMEOUT_VAR);
+    if (guc_value != NULL) {
+        plv8_context_idle_timeout = plv8_int_option(guc_value);
+    } else {
+        DefineCustomIntVariable(CONTEXT_IDLE_TIMEOUT_VAR,
+                                gettext_noop("Time after which an unused per-user context is disposed of."),
+                                gettext_noop("Checked at the end of each transaction and when a context is created.  "
+                                             "0 disables it."),
+                                &plv8_context_idle_timeout,
+                                0, 0, INT_MAX / 1000,
+                                PGC_SUSET, GUC_UNIT_S,
+#if PG_VERSION_NUM >= 90100
+                                NULL,
+#endif
+                                NULL,
+                                NULL);
+    }
+#undef CONTEXT_IDLE_TIMEOUT_VAR
+
+#define IDLE_GC_TIME_VAR "plv8.idle_gc_time"
+    guc_value = plv8_find_option(IDLE_GC_TIME_VAR);
+    if (guc_value != NULL) {
+        plv8_idle_gc_time = plv8_int_option(guc_value);
+    } else {
+        DefineCustomIntVariable(IDLE_GC_TIME_VAR,
+                                gettext_noop("Time given to garbage collection at the end of a transaction."),
+                                gettext_noop("Shared by the isolates used in the transaction.  "
+                                             "0 disables it."),
+                                &plv8_idle_gc_time,
+                                0, 0, 1000,
+                                PGC_USERSET, GUC_UNIT_MS,
+#if PG_VERSION_NUM >= 90100
+                                NULL,
+#endif
+                                NULL,
+                                NULL);
+    }
+#undef IDLE_GC_TIME_VAR
+
+#define IDLE_TRIM_TIMEOUT_VAR "plv8.idle_trim_timeout"
+    guc_value = plv8_find_option(IDLE_TRIM_TIMEOUT_VAR);
+    if (guc_value != NULL) {
+        plv8_idle_trim_timeout = plv8_int_option(guc_value);
+    } else {
+        DefineCustomIntVariable(IDLE_TRIM_TIMEOUT_VAR,
+                                gettext_noop("Time after which an unused per-user context releases its free memory."),
+                                gettext_noop("Checked at the end of each transaction, which is delayed by it.  "
+                                             "0 disables it."),
+                                &plv8_idle_trim_timeout,
+                                0, 0, INT_MAX / 1000,
+                                PGC_SUSET, GUC_UNIT_S,
+#if PG_VERSION_NUM >= 90100
+                                NULL,
+#endif
+                                NULL,
+                                NULL);
+    }
+#undef IDLE_TRIM_TIMEOUT_VAR
+
 	RegisterXactCallback(plv8_xact_cb, NULL);
 
 	EmitWarningsOnPlaceholders("plv8");
 
+	/*
+	 * Loading the ICU and startup data starts no threads, so it's done in
+	 * the postmaster as well when PLV8 is in shared_preload_libraries, and
+	 * the backends forked from it share the pages.  V8 itself starts worker
+	 * threads, which don't survive a fork, so then each backend initializes
+	 * it on first use.
+	 */
 	if (plv8_icu_data == NULL) {
 		elog(DEBUG1, "no icu dir");
 		V8::InitializeICU();
@@ -470,6 +936,17 @@ _PG_init(void)
 #if (V8_MAJOR_VERSION == 4 && V8_MINOR_VERSION >= 6) || V8_MAJOR_VERSION >= 5
 	V8::InitializeExternalStartupData("plv8");
 #endif
+
+	if (!process_shared_preload_libraries_in_progress)
+		plv8_initialize_v8();
+}
+
+static void
+plv8_initialize_v8()
+{
+	if (v8_initialized)
+		return;
+
 	if (!v8_platform) {
 		v8_platform = platform::NewDefaultPlatform();
 	}
@@ -477,10 +954,14 @@ _PG_init(void)
 	if (plv8_v8_flags != NULL) {
 		V8::SetFlagsFromString(plv8_v8_flags);
 	}
+	if (plv8_jitless) {
+		V8::SetFlagsFromString("--jitless");
+	}
 
 	V8::InitializePlatform(v8_platform.get());
 
 	V8::Initialize();
+	v8_initialized = true;
 }
 
 static void
@@ -501,111 +982,972 @@ plv8_xact_cb(XactEvent event, void *arg)
 		 */
 	}
 	exec_env_head = NULL;
+
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PREPARE:
+			plv8_free_dead_procs();
+			plv8_free_external_datums();
+			/* Preloaded, plv8 has no isolate until it is first used */
+			if (!v8_initialized)
+				break;
+			/* A context used in this transaction is not idle */
+			if (plv8_context_idle_timeout > 0)
+				EvictPlv8Contexts(GetCurrentTransactionStartTimestamp(), false);
+			if (plv8_idle_gc_time > 0 || plv8_idle_trim_timeout > 0)
+				IdleNotification(GetCurrentTransactionStartTimestamp());
+			break;
+		default:
+			break;
+	}
 }
 
-static inline plv8_exec_env *
-plv8_new_exec_env(Isolate *isolate)
+/*
+ * Move a call descriptor, already unlinked from its cache entry, to
+ * dead_procs.  It's freed by plv8_free_dead_procs, as calls still running
+ * may use it, and call sites stop trusting the descriptor they kept.
+ */
+static void
+plv8_retire_proc(plv8_proc *proc)
 {
-	plv8_exec_env	   *xenv = (plv8_exec_env *)
-		MemoryContextAllocZero(TopTransactionContext, sizeof(plv8_exec_env));
+	proc->stale = true;
+	proc->next = dead_procs;
+	dead_procs = proc;
+	plv8_proc_generation++;
+}
 
-	new(&xenv->context) Persistent<Context>();
-	new(&xenv->recv) Persistent<Object>();
-	xenv->isolate = isolate;
+/*
+ * Move call descriptors out of the cache.
+ */
+static void
+plv8_drop_procs(plv8_proc_cache *cache)
+{
+	while (cache->procs)
+	{
+		plv8_proc	   *proc = cache->procs;
 
-	/*
-	 * Add it to the list, which will be freed in the end of top transaction.
-	 */
-	xenv->next = exec_env_head;
-	exec_env_head = xenv;
+		cache->procs = proc->next;
+		plv8_retire_proc(proc);
+	}
+}
 
-	return xenv;
+/*
+ * Drop the least recently used function from the cache.  It's freed by
+ * plv8_free_dead_procs, as calls still running may use it; retiring its
+ * descriptors keeps call sites from using them after that.
+ */
+static void
+plv8_evict_proc_cache(plv8_proc_cache *cache)
+{
+	plv8_proc_key	key;
+
+	key.fn_oid = cache->fn_oid;
+	key.user_id = cache->user_id;
+	hash_search(plv8_proc_cache_hash, &key, HASH_REMOVE, NULL);
+
+	if (cache->prosrc)
+	{
+		pfree(cache->prosrc);
+		cache->prosrc = NULL;
+	}
+	cache->function.Reset();
+	plv8_clear_exec_env(cache->xenv);
+	plv8_drop_procs(cache);
+
+	dlist_delete(&cache->lru_node);
+	dlist_push_head(&plv8_proc_evicted, &cache->lru_node);
 }
 
-Datum
-plv8_call_handler(PG_FUNCTION_ARGS)
+static void
+plv8_free_dead_procs()
 {
-	current_context = GetPlv8Context();
-	Oid		fn_oid = fcinfo->flinfo->fn_oid;
-	bool	is_trigger = CALLED_AS_TRIGGER(fcinfo);
+	plv8_proc	  **link = &dead_procs;
 
-	try
+	while (*link)
 	{
-#ifdef ENABLE_DEBUGGER_SUPPORT
-		Locker				lock;
-#endif  // ENABLE_DEBUGGER_SUPPORT
-		Isolate::Scope	scope(current_context->isolate);
-		HandleScope	handle_scope(current_context->isolate);
+		plv8_proc	   *proc = *link;
 
-		if (!fcinfo->flinfo->fn_extra)
+		if (proc->use_count > 0)
 		{
-			plv8_proc	   *proc = Compile(fn_oid, fcinfo,
-										   false, is_trigger);
-			proc->xenv = CreateExecEnv(proc->cache->function, current_context);
-			fcinfo->flinfo->fn_extra = proc;
+			link = &proc->next;
+			continue;
 		}
-
-		plv8_proc *proc = (plv8_proc *) fcinfo->flinfo->fn_extra;
-		plv8_proc_cache *cache = proc->cache;
-
-		if (is_trigger)
-			return CallTrigger(fcinfo, proc->xenv);
-		else if (cache->retset)
-			return CallSRFunction(fcinfo, proc->xenv,
-						cache->nargs, proc->argtypes, &proc->rettype);
-		else
-			return CallFunction(fcinfo, proc->xenv,
-						cache->nargs, proc->argtypes, &proc->rettype);
+		*link = proc->next;
+		MemoryContextDelete(proc->mcxt);
 	}
-	catch (js_error& e)	{ e.rethrow(); }
-	catch (pg_error& e)	{ e.rethrow(); }
-
-	return (Datum) 0;	// keep compiler quiet
-}
 
+	dlist_mutable_iter	iter;
 
-static void killPlv8Context(plv8_context *ctx) {
-	HASH_SEQ_STATUS		status;
-	plv8_proc_cache*	cache;
+	dlist_foreach_modify(iter, &plv8_proc_evicted)
+	{
+		plv8_proc_cache	   *cache = dlist_container(plv8_proc_cache, lru_node, iter.cur);
+		bool				in_use = false;
 
-	// need to search and reset all the user functions which were created in the old context
-	hash_seq_init(&status, plv8_proc_cache_hash);
-	cache = (plv8_proc_cache *) hash_seq_search(&status);
-	while (cache != nullptr) {
-		if (cache->user_id == ctx->user_id) {
-			if (cache->prosrc)
+		for (plv8_proc *proc = dead_procs; proc; proc = proc->next)
+		{
+			if (proc->cache == cache)
 			{
-				pfree(cache->prosrc);
-				cache->prosrc = NULL;
+				in_use = true;
+				break;
 			}
-			cache->function.Reset();
 		}
-		cache = (plv8_proc_cache *) hash_seq_search(&status);
+		if (in_use)
+			continue;
+
+		dlist_delete(iter.cur);
+		pfree(cache->xenv);
+		pfree(cache);
 	}
-	ctx->isolate->Dispose();
-	delete ctx->array_buffer_allocator;
 }
 
-Datum
-plv8_reset(PG_FUNCTION_ARGS)
+static inline bool
+plv8_proc_uses_type(plv8_proc *proc, uint32 hashvalue)
 {
-	Oid					user_id = GetUserId();
-	unsigned long		i;
+	int		nargs = proc->cache->nargs;
+
+	if (GetSysCacheHashValue1(TYPEOID, ObjectIdGetDatum(proc->rettypid)) == hashvalue ||
+		GetSysCacheHashValue1(TYPEOID, ObjectIdGetDatum(proc->rettype.typid)) == hashvalue)
+		return true;
+	for (int i = 0; i < nargs; i++)
+	{
+		if (GetSysCacheHashValue1(TYPEOID, ObjectIdGetDatum(proc->argtypids[i])) == hashvalue ||
+			GetSysCacheHashValue1(TYPEOID, ObjectIdGetDatum(proc->argtypes[i].typid)) == hashvalue)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Syscache invalidation callback.  A changed pg_proc row invalidates the
+ * cached function, a changed pg_type row the call descriptors using that
+ * type.  Nothing is freed here, as invalidations can arrive while the
+ * function runs; the next call notices and rebuilds what it needs.
+ * A hashvalue of zero means the whole cache is invalidated.
+ */
+static void
+plv8_syscache_cb(Datum arg, int cacheid, uint32 hashvalue)
+{
+	dlist_iter			iter;
+
+	dlist_foreach(iter, &plv8_proc_lru)
+	{
+		plv8_proc_cache	   *cache = dlist_container(plv8_proc_cache, lru_node, iter.cur);
+
+		if (cacheid == PROCOID)
+		{
+			if (hashvalue == 0 ||
+				GetSysCacheHashValue1(PROCOID, ObjectIdGetDatum(cache->fn_oid)) == hashvalue)
+				cache->valid = false;
+			continue;
+		}
+
+		for (plv8_proc *proc = cache->procs; proc; proc = proc->next)
+		{
+			if (hashvalue == 0 || plv8_proc_uses_type(proc, hashvalue))
+				proc->stale = true;
+		}
+	}
+}
+
+static inline plv8_exec_env *
+plv8_alloc_exec_env(MemoryContext mcxt)
+{
+	plv8_exec_env	   *xenv = (plv8_exec_env *)
+		MemoryContextAllocZero(mcxt, sizeof(plv8_exec_env));
+
+	new(&xenv->context) Persistent<Context>();
+	new(&xenv->recv) Persistent<Object>();
+
+	return xenv;
+}
+
+static inline void
+plv8_clear_exec_env(plv8_exec_env *xenv)
+{
+	xenv->recv.Reset();
+	xenv->context.Reset();
+}
+
+static inline plv8_exec_env *
+plv8_new_exec_env(Isolate *isolate)
+{
+	plv8_exec_env	   *xenv = plv8_alloc_exec_env(TopTransactionContext);
+
+	xenv->isolate = isolate;
+
+	/*
+	 * Add it to the list, which will be freed in the end of top transaction.
+	 */
+	xenv->next = exec_env_head;
+	exec_env_head = xenv;
+
+	return xenv;
+}
+
+Datum
+plv8_call_handler(PG_FUNCTION_ARGS)
+{
+	current_context = GetPlv8Context();
+	Oid		fn_oid = fcinfo->flinfo->fn_oid;
+	bool	is_trigger = CALLED_AS_TRIGGER(fcinfo);
+	/* The SPI state of the calling DoCall, if this call is nested */
+	plv8_spi_state *prev_spi = current_spi;
+	Datum	result;
+
+	/*
+	 * Free the datums V8 let go of since, rather than keeping them until
+	 * the transaction ends.
+	 */
+	plv8_free_external_datums();
+
+	try
+	{
+#ifdef ENABLE_DEBUGGER_SUPPORT
+		Locker				lock;
+#endif  // ENABLE_DEBUGGER_SUPPORT
+		Isolate::Scope	scope(current_context->isolate);
+		HandleScope	handle_scope(current_context->isolate);
+
+		plv8_call_site *site = (plv8_call_site *) fcinfo->flinfo->fn_extra;
+		plv8_proc	   *proc = NULL;
+
+		/*
+		 * The function or its types may have been invalidated since this
+		 * call site was set up, or its descriptor retired and freed.
+		 * Otherwise, Compile returns the cached function and call
+		 * descriptor without catalog lookups.
+		 */
+		if (site && site->generation == plv8_proc_generation)
+			proc = site->proc;
+		if (!proc || proc->stale || !proc->cache->valid ||
+			proc->cache->function.IsEmpty())
+		{
+			proc = Compile(fn_oid, fcinfo, false, is_trigger);
+			if (!site)
+			{
+				site = (plv8_call_site *)
+					MemoryContextAlloc(fcinfo->flinfo->fn_mcxt, sizeof(plv8_call_site));
+				fcinfo->flinfo->fn_extra = site;
+			}
+			site->proc = proc;
+			site->generation = plv8_proc_generation;
+		}
+
+		ProcInUse		in_use(proc);
+		plv8_proc_cache *cache = proc->cache;
+		plv8_exec_env	*xenv = GetExecEnv(cache, current_context);
+
+		if (is_trigger)
+			result = CallTrigger(fcinfo, xenv);
+		else if (cache->retset)
+			result = CallSRFunction(fcinfo, xenv,
+						cache->nargs, proc->argtypes, &proc->rettype);
+		else
+			result = CallFunction(fcinfo, xenv,
+						cache->nargs, proc->argtypes, &proc->rettype);
+		current_spi = prev_spi;
+		plv8_free_external_datums();
+		return result;
+	}
+	catch (js_error& e)	{ current_spi = prev_spi; e.rethrow(); }
+	catch (pg_error& e)	{ current_spi = prev_spi; e.rethrow(); }
+
+	return (Datum) 0;	// keep compiler quiet
+}
+
+
+/*
+ * Forget the compiled functions of a user, as they refer to its isolate.
+ */
+static void
+ForgetUserFunctions(Oid user_id)
+{
+	dlist_iter			iter;
+
+	dlist_foreach(iter, &plv8_proc_lru) {
+		plv8_proc_cache	   *cache = dlist_container(plv8_proc_cache, lru_node, iter.cur);
+
+		if (cache->user_id == user_id) {
+			if (cache->prosrc)
+			{
+				pfree(cache->prosrc);
+				cache->prosrc = NULL;
+			}
+			cache->function.Reset();
+			plv8_clear_exec_env(cache->xenv);
+		}
+	}
+}
+
+static void killPlv8Context(plv8_context *ctx) {
+	plv8_exec_env	   *env;
+
+	// need to search and reset all the user functions which were created in the old context
+	ForgetUserFunctions(ctx->user_id);
+	for (env = exec_env_head; env != NULL; env = env->next)
+	{
+		if (env->isolate == ctx->isolate)
+			plv8_clear_exec_env(env);
+	}
+	WatchdogSync();
+	ctx->isolate->Dispose();
+	delete ctx->array_buffer_allocator;
+}
 
-	for (i = 0; i < ContextVector.size(); i++)
+static bool
+plv8_context_idle(plv8_context *ctx, TimestampTz now)
+{
+	return plv8_context_idle_timeout > 0 &&
+		TimestampDifferenceExceeds(ctx->last_used, now,
+								   plv8_context_idle_timeout * 1000);
+}
+
+static void
+RegisterContext(plv8_context *context)
+{
+	ContextVector.push_back(context);
+	ContextMap[context->user_id] = context;
+}
+
+static void
+UnregisterContext(plv8_context *context)
+{
+	auto	found = ContextMap.find(context->user_id);
+
+	if (found != ContextMap.end() && found->second == context)
+		ContextMap.erase(found);
+	ContextVector.erase(std::remove(ContextVector.begin(), ContextVector.end(), context),
+						ContextVector.end());
+	if (last_context == context)
+		last_context = nullptr;
+}
+
+static void
+EvictPlv8Context(size_t i)
+{
+	plv8_context   *context = ContextVector[i];
+
+	UnregisterContext(context);
+	evicted_users.emplace(context->user_id, 0);
+	plv8_context_evictions++;
+	if (current_context == context)
+		current_context = nullptr;
+	killPlv8Context(context);
+	pfree(context);
+}
+
+/*
+ * Disposes of the contexts idle for longer than plv8.context_idle_timeout
+ * and, to make room for a new one, the least recently used ones beyond
+ * plv8.max_contexts.  A context whose isolate is running code is kept.
+ */
+static void
+EvictPlv8Contexts(TimestampTz now, bool make_room)
+{
+	size_t		i = 0;
+
+	if (!v8_initialized)
+		return;
+
+	while (i < ContextVector.size())
 	{
-		if (ContextVector[i]->user_id == user_id)
+		if (!ContextVector[i]->isolate->IsInUse() &&
+			plv8_context_idle(ContextVector[i], now))
+			EvictPlv8Context(i);
+		else
+			i++;
+	}
+
+	if (!make_room || plv8_max_contexts <= 0)
+		return;
+
+	while (ContextVector.size() >= (size_t) plv8_max_contexts)
+	{
+		size_t		victim = ContextVector.size();
+
+		for (i = 0; i < ContextVector.size(); i++)
 		{
-			plv8_context * context = ContextVector[i];
-			ContextVector.erase(ContextVector.begin() + i);
-			killPlv8Context(context);
-			pfree(context);
+			if (ContextVector[i]->isolate->IsInUse())
+				continue;
+			if (victim == ContextVector.size() ||
+				ContextVector[i]->last_used < ContextVector[victim]->last_used)
+				victim = i;
+		}
+		if (victim == ContextVector.size())
 			break;
+		EvictPlv8Context(victim);
+	}
+}
+
+/*
+ * Called at the end of a transaction, before the backend waits for the next
+ * command.  PostgreSQL has no hook while it waits, so this delays the reply
+ * to the client.  The isolates used in the transaction get plv8.idle_gc_time
+ * to collect garbage, so that less of it is collected while code runs.  One
+ * isolate unused for plv8.idle_trim_timeout collects all it can and gives
+ * the freed memory back, once per idle period.
+ */
+static void
+IdleNotification(TimestampTz xact_start)
+{
+	double		deadline = v8_platform->MonotonicallyIncreasingTime() +
+		plv8_idle_gc_time / 1000.0;
+	bool		trimmed = false;
+
+	for (plv8_context *context : ContextVector)
+	{
+		Isolate	   *isolate = context->isolate;
+
+		if (context->is_dead || isolate->IsInUse())
+			continue;
+
+		if (context->last_used >= xact_start)
+		{
+			if (plv8_idle_gc_time <= 0 ||
+				v8_platform->MonotonicallyIncreasingTime() >= deadline)
+				continue;
+
+			Isolate::Scope	scope(isolate);
+
+			/*
+			 * V8 deprecates this in favor of MemoryPressureNotification,
+			 * which can't be given a time limit.
+			 */
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#elif defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable: 4996)
+#endif
+			isolate->IdleNotificationDeadline(deadline);
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#elif defined(_MSC_VER)
+#pragma warning(pop)
+#endif
+		}
+		else if (plv8_idle_trim_timeout > 0 && !trimmed && !context->trimmed &&
+				 TimestampDifferenceExceeds(context->last_used, xact_start,
+											plv8_idle_trim_timeout * 1000))
+		{
+			Isolate::Scope	scope(isolate);
+
+			isolate->LowMemoryNotification();
+			context->trimmed = true;
+			trimmed = true;
 		}
 	}
+}
+
+static void
+DropPlv8Context(Oid user_id)
+{
+	auto	found = ContextMap.find(user_id);
+
+	if (found != ContextMap.end())
+	{
+		plv8_context * context = found->second;
+
+		/* Only a dead isolate can be left entered, by the OOM handler */
+		if (context->isolate->IsInUse())
+		{
+			if (!context->is_dead && !context->isolate->IsDead())
+				ereport(ERROR,
+						(errcode(ERRCODE_OBJECT_IN_USE),
+						 errmsg("cannot dispose of a plv8 context while it is running code")));
+			context->isolate->Exit();
+		}
+		UnregisterContext(context);
+		killPlv8Context(context);
+		pfree(context);
+	}
+}
+
+/*
+ * Replaces the global context of a plv8 context with a fresh one, keeping
+ * the isolate and its templates.  Only the user's compiled functions are
+ * forgotten, as they belong to the old global context.
+ */
+static void
+ResetPlv8Context(plv8_context *context)
+{
+	Isolate			   *isolate = context->isolate;
+	plv8_exec_env	   *env;
+
+	if (isolate->IsInUse())
+		throw js_error("cannot reset a plv8 context while it is running code");
+
+	ForgetUserFunctions(context->user_id);
+	for (env = exec_env_head; env != NULL; env = env->next)
+	{
+		if (env->isolate == isolate)
+			plv8_clear_exec_env(env);
+	}
+	context->unhandled_promises.clear();
+	context->interrupted = false;
+
+	Isolate::Scope		scope(isolate);
+
+	context->context.Reset();
+	isolate->ContextDisposedNotification();
+	current_context = context;
+	InitGlobalContext(context);
+}
+
+Datum
+plv8_reset(PG_FUNCTION_ARGS)
+{
+	Oid				user_id = GetUserId();
+	bool			keep_isolate = PG_NARGS() > 0 && PG_GETARG_BOOL(0);
+
+	/* A dead isolate can't be reused */
+	if (keep_isolate)
+	{
+		for (size_t i = 0; i < ContextVector.size(); i++)
+		{
+			plv8_context   *context = ContextVector[i];
+
+			if (context->user_id != user_id)
+				continue;
+			if (context->is_dead || context->isolate->IsDead())
+				break;
+
+			try
+			{
+				ResetPlv8Context(context);
+			}
+			catch (js_error& e)	{ e.rethrow(); }
+			catch (pg_error& e)	{ e.rethrow(); }
+			return (Datum) 0;
+		}
+	}
+
+	DropPlv8Context(user_id);
 	return (Datum) 0;
 }
 
+static void
+plv8_snapshot_path(char *path, Oid user_id)
+{
+	snprintf(path, MAXPGPATH, PLV8_SNAPSHOT_DIR "/snapshot.%u.%u",
+			 MyDatabaseId, user_id);
+}
+
+/*
+ * Hashes the source of the start procedure, so that a snapshot is not used
+ * once the procedure changes.  Returns false if the start procedure can't
+ * be run by the current user, in which case no snapshot should be used
+ * either.
+ */
+static bool
+plv8_start_proc_hash(uint64 *hash)
+{
+	Oid			funcoid;
+	HeapTuple	tuple;
+	Datum		prosrc;
+	bool		isnull;
+	char	   *source;
+
+	funcoid = DatumGetObjectId(DirectFunctionCall1(regprocin,
+							CStringGetDatum(plv8_start_proc)));
+	if (!DatumGetBool(DirectFunctionCall2(has_function_privilege_id,
+							ObjectIdGetDatum(funcoid),
+							CStringGetTextDatum("EXECUTE"))))
+		return false;
+
+	tuple = SearchSysCache(PROCOID, ObjectIdGetDatum(funcoid), 0, 0, 0);
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "cache lookup failed for function %u", funcoid);
+	prosrc = SysCacheGetAttr(PROCOID, tuple, Anum_pg_proc_prosrc, &isnull);
+	if (isnull)
+		elog(ERROR, "null prosrc");
+	source = TextDatumGetCString(prosrc);
+	ReleaseSysCache(tuple);
+
+	*hash = plv8_hash_bytes(source, strlen(source), 0);
+	pfree(source);
+	return true;
+}
+
+static void
+plv8_snapshot_fill_header(plv8_snapshot_header *header)
+{
+	const char *flags = plv8_v8_flags ? plv8_v8_flags : "";
+	const char *start_proc = plv8_start_proc ? plv8_start_proc : "";
+
+	memset(header, 0, sizeof(plv8_snapshot_header));
+	memcpy(header->magic, PLV8_SNAPSHOT_MAGIC, sizeof(header->magic));
+	strlcpy(header->v8_version, V8::GetVersion(), sizeof(header->v8_version));
+	strlcpy(header->plv8_version, PLV8_VERSION, sizeof(header->plv8_version));
+	header->v8_flags_hash = plv8_hash_bytes(flags, strlen(flags), plv8_jitless);
+	header->start_proc_hash = plv8_hash_bytes(start_proc, strlen(start_proc), 0);
+}
+
+/*
+ * Maps a snapshot file read-only, so that all backends booting from it share
+ * its pages.  The mapping is kept for the life of the backend, as isolates
+ * booted from it refer to it; plv8_build_snapshot replaces the file with a
+ * rename, which leaves the mapped one alone.
+ */
+static char *
+plv8_snapshot_map(const char *path, int *len)
+{
+#ifndef WIN32
+	FILE	   *file;
+	struct stat	st;
+	void	   *data;
+
+	file = AllocateFile(path, PG_BINARY_R);
+	if (file == NULL)
+		return NULL;
+
+	if (fstat(fileno(file), &st) < 0 || st.st_size == 0 ||
+		st.st_size > (off_t) MaxAllocSize)
+	{
+		FreeFile(file);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(file), 0);
+	FreeFile(file);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	*len = (int) st.st_size;
+	return (char *) data;
+#else
+	MemoryContext	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	char		   *data = plv8_code_cache_read(path, len);
+
+	MemoryContextSwitchTo(oldcontext);
+	return data;
+#endif
+}
+
+static plv8_snapshot_entry *
+plv8_snapshot_load(Oid user_id)
+{
+	plv8_snapshot_entry	   *entry = &plv8_snapshots[user_id];
+	char					path[MAXPGPATH];
+	char				   *data;
+	int						len;
+
+	entry->blob.data = NULL;
+	entry->blob.raw_size = 0;
+	plv8_snapshot_path(path, user_id);
+
+	data = plv8_snapshot_map(path, &len);
+	if (data == NULL)
+		return entry;
+
+	memcpy(&entry->info, data, Min((size_t) len, sizeof(plv8_snapshot_header)));
+	if ((size_t) len < sizeof(plv8_snapshot_header) ||
+		memcmp(entry->info.magic, PLV8_SNAPSHOT_MAGIC, sizeof(entry->info.magic)) != 0 ||
+		entry->info.blob_size != len - sizeof(plv8_snapshot_header) ||
+		entry->info.user_id != user_id)
+	{
+		elog(WARNING, "ignoring invalid plv8 snapshot \"%s\"", path);
+#ifndef WIN32
+		munmap(data, len);
+#else
+		pfree(data);
+#endif
+		return entry;
+	}
+
+	entry->blob.data = data + sizeof(plv8_snapshot_header);
+	entry->blob.raw_size = entry->info.blob_size;
+	return entry;
+}
+
+/*
+ * Returns the snapshot a new context of the user can be restored from, or
+ * NULL.  Only a snapshot built for the same user is restored, as the start
+ * up procedure may have kept anything it could read in it.  Any problem
+ * falls back to creating the context from scratch, which reports it.
+ */
+static const StartupData *
+plv8_snapshot_usable(Oid user_id)
+{
+	plv8_snapshot_header	header;
+	plv8_snapshot_entry	   *entry;
+	MemoryContext			ctx = CurrentMemoryContext;
+	bool					usable = true;
+	auto					found = plv8_snapshots.find(user_id);
+
+	entry = found != plv8_snapshots.end() ? &found->second : plv8_snapshot_load(user_id);
+	if (entry->blob.data == NULL || entry->info.user_id != user_id)
+		return NULL;
+
+	plv8_snapshot_fill_header(&header);
+	if (strcmp(header.v8_version, entry->info.v8_version) != 0 ||
+		strcmp(header.plv8_version, entry->info.plv8_version) != 0 ||
+		header.v8_flags_hash != entry->info.v8_flags_hash ||
+		header.start_proc_hash != entry->info.start_proc_hash)
+		return NULL;
+
+	if (plv8_start_proc == NULL || plv8_start_proc[0] == '\0')
+		return &entry->blob;
+
+	PG_TRY();
+	{
+		usable = plv8_start_proc_hash(&header.prosrc_hash) &&
+			header.prosrc_hash == entry->info.prosrc_hash;
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(ctx);
+		FlushErrorState();
+		usable = false;
+	}
+	PG_END_TRY();
+
+	return usable ? &entry->blob : NULL;
+}
+
+Datum
+plv8_build_snapshot(PG_FUNCTION_ARGS)
+{
+	plv8_snapshot_header	header;
+	StartupData				blob = { NULL, 0 };
+	char					path[MAXPGPATH];
+	char					tmppath[MAXPGPATH];
+	char					dir[MAXPGPATH] = PLV8_SNAPSHOT_DIR;
+	FILE				   *file;
+	Oid						role = GetUserId();
+	Oid						save_userid;
+	int						save_sec_context;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to build a plv8 snapshot")));
+
+	if (!PG_ARGISNULL(0))
+		role = PG_GETARG_OID(0);
+
+	/* Run the start up procedure as the role the snapshot is restored for */
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+	SetUserIdAndSecContext(role, save_sec_context | SECURITY_LOCAL_USERID_CHANGE);
+
+	plv8_snapshot_fill_header(&header);
+	header.user_id = role;
+	if (plv8_start_proc != NULL && plv8_start_proc[0] != '\0' &&
+		!plv8_start_proc_hash(&header.prosrc_hash))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("no permission to execute js function %s", plv8_start_proc)));
+
+	/* The functions compiled so far can't be serialized, start over. */
+	DropPlv8Context(role);
+	plv8_initialize_v8();
+
+	try
+	{
+		blob = BuildSnapshot();
+	}
+	catch (js_error& e) { e.rethrow(); }
+	catch (pg_error& e) { e.rethrow(); }
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+
+	header.blob_size = blob.raw_size;
+	plv8_snapshot_path(path, role);
+	snprintf(tmppath, MAXPGPATH, "%s.%d.tmp", path, MyProcPid);
+
+	file = AllocateFile(tmppath, PG_BINARY_W);
+	if (file == NULL && errno == ENOENT && pg_mkdir_p(dir, S_IRWXU) == 0)
+		file = AllocateFile(tmppath, PG_BINARY_W);
+	if (file == NULL)
+	{
+		delete[] blob.data;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", tmppath)));
+	}
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+		fwrite(blob.data, 1, blob.raw_size, file) != (size_t) blob.raw_size)
+	{
+		FreeFile(file);
+		unlink(tmppath);
+		delete[] blob.data;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", tmppath)));
+	}
+	delete[] blob.data;
+
+	if (FreeFile(file) != 0 || rename(tmppath, path) != 0)
+	{
+		unlink(tmppath);
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", path)));
+	}
+
+	/*
+	 * Pick up the new snapshot for the next context.  The previous blob is
+	 * left alone, as isolates booted from it may still refer to it.
+	 */
+	plv8_snapshots.erase(role);
+	PG_RETURN_VOID();
+}
+
+static void
+plv8_prewarm_function(Oid fn_oid, bool is_trigger)
+{
+	try
+	{
+		current_context = GetPlv8Context();
+		Isolate::Scope	scope(current_context->isolate);
+
+		plv8_proc	   *proc = Compile(fn_oid, NULL, true, is_trigger);
+		(void) GetExecEnv(proc->cache, current_context);
+	}
+	catch (js_error& e)	{ e.rethrow(); }
+	catch (pg_error& e)	{ e.rethrow(); }
+}
+
+/*
+ * Compiles the plv8 functions the current user can execute in the schemas
+ * matching a LIKE pattern, the same way the validator does, so that their
+ * first calls don't pay for it.  A function that fails to compile is
+ * reported and skipped.
+ */
+static void
+plv8_prewarm_functions(const char *schema_pattern, int *compiled, int *failed)
+{
+	MemoryContext	oldcontext = CurrentMemoryContext;
+	ResourceOwner	oldowner = CurrentResourceOwner;
+	Oid				argtypes[1] = { TEXTOID };
+	Datum			values[1];
+	Oid			   *fn_oids;
+	bool		   *is_triggers;
+	uint64			nfuncs;
+	uint64			i;
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "could not connect to SPI manager");
+
+	values[0] = CStringGetTextDatum(schema_pattern);
+	if (SPI_execute_with_args(
+			"SELECT p.oid, p.prorettype = 'pg_catalog.trigger'::pg_catalog.regtype"
+			" FROM pg_catalog.pg_proc p"
+			" JOIN pg_catalog.pg_namespace n ON n.oid = p.pronamespace"
+			" JOIN pg_catalog.pg_language l ON l.oid = p.prolang"
+			" WHERE l.lanname = 'plv8' AND n.nspname LIKE $1"
+			" AND pg_catalog.has_function_privilege(p.oid, 'EXECUTE')"
+			" ORDER BY p.oid",
+			1, argtypes, values, NULL, true, 0) != SPI_OK_SELECT)
+		elog(ERROR, "could not list plv8 functions");
+
+	nfuncs = SPI_processed;
+	fn_oids = (Oid *) MemoryContextAlloc(oldcontext, sizeof(Oid) * (nfuncs + 1));
+	is_triggers = (bool *) MemoryContextAlloc(oldcontext, sizeof(bool) * (nfuncs + 1));
+	for (i = 0; i < nfuncs; i++)
+	{
+		HeapTuple	tuple = SPI_tuptable->vals[i];
+		bool		isnull;
+
+		fn_oids[i] = DatumGetObjectId(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1, &isnull));
+		is_triggers[i] = DatumGetBool(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 2, &isnull));
+	}
+	SPI_finish();
+
+	for (i = 0; i < nfuncs; i++)
+	{
+		instr_time	start_time;
+		instr_time	duration;
+
+		INSTR_TIME_SET_CURRENT(start_time);
+		BeginInternalSubTransaction(NULL);
+		MemoryContextSwitchTo(oldcontext);
+
+		PG_TRY();
+		{
+			plv8_prewarm_function(fn_oids[i], is_triggers[i]);
+
+			ReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(oldcontext);
+			CurrentResourceOwner = oldowner;
+
+			INSTR_TIME_SET_CURRENT(duration);
+			INSTR_TIME_SUBTRACT(duration, start_time);
+			elog(DEBUG1, "compiled function %s in %.3f ms",
+				 format_procedure(fn_oids[i]), INSTR_TIME_GET_MILLISEC(duration));
+			(*compiled)++;
+		}
+		PG_CATCH();
+		{
+			ErrorData	   *edata;
+
+			MemoryContextSwitchTo(oldcontext);
+			edata = CopyErrorData();
+			FlushErrorState();
+
+			RollbackAndReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(oldcontext);
+			CurrentResourceOwner = oldowner;
+
+			ereport(WARNING,
+					(errmsg("could not compile function %s: %s",
+							format_procedure(fn_oids[i]), edata->message)));
+			FreeErrorData(edata);
+			(*failed)++;
+		}
+		PG_END_TRY();
+	}
+
+	pfree(fn_oids);
+	pfree(is_triggers);
+}
+
+Datum
+plv8_prewarm(PG_FUNCTION_ARGS)
+{
+	const char	   *schema_pattern = "%";
+	Oid				role = GetUserId();
+	Oid				save_userid;
+	int				save_sec_context;
+	int				compiled = 0;
+	int				failed = 0;
+	instr_time		start_time;
+	instr_time		duration;
+	StringInfoData	result;
+
+	if (!PG_ARGISNULL(0))
+		schema_pattern = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	if (!PG_ARGISNULL(1))
+		role = PG_GETARG_OID(1);
+
+	if (!has_privs_of_role(GetUserId(), role))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must have privileges of role \"%s\" to prewarm its functions",
+						GetUserNameFromId(role, false))));
+
+	/* Compile into the context of the role */
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+	SetUserIdAndSecContext(role, save_sec_context | SECURITY_LOCAL_USERID_CHANGE);
+
+	INSTR_TIME_SET_CURRENT(start_time);
+	plv8_prewarm_functions(schema_pattern, &compiled, &failed);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start_time);
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+
+	initStringInfo(&result);
+	appendStringInfo(&result, "{\"compiled\":%d,\"failed\":%d,\"elapsed_ms\":%.3f}",
+					 compiled, failed, INSTR_TIME_GET_MILLISEC(duration));
+
+	return CStringGetTextDatum(result.data);
+}
+
 Datum
 plv8_info(PG_FUNCTION_ARGS)
 {
@@ -660,6 +2002,19 @@ plv8_info(PG_FUNCTION_ARGS)
            v8::String::NewFromUtf8(isolate, username).ToLocalChecked()).Check();
 		GetMemoryInfo(obj);
 
+		Local<v8::Object>	code_cache = v8::Object::New(isolate);
+		code_cache->Set(context, v8::String::NewFromUtf8Literal(isolate, "hits"),
+			Number::New(isolate, ContextVector[i]->code_cache_hits)).Check();
+		code_cache->Set(context, v8::String::NewFromUtf8Literal(isolate, "misses"),
+			Number::New(isolate, ContextVector[i]->code_cache_misses)).Check();
+		code_cache->Set(context, v8::String::NewFromUtf8Literal(isolate, "rejects"),
+			Number::New(isolate, ContextVector[i]->code_cache_rejects)).Check();
+		obj->Set(context, v8::String::NewFromUtf8Literal(isolate, "code_cache"), code_cache).Check();
+		obj->Set(context, v8::String::NewFromUtf8Literal(isolate, "evictions"),
+			Number::New(isolate, plv8_context_evictions)).Check();
+		obj->Set(context, v8::String::NewFromUtf8Literal(isolate, "recreations"),
+			Number::New(isolate, ContextVector[i]->recreations)).Check();
+
 		result = JSON.Stringify(obj);
 		CString str(result);
 
@@ -695,6 +2050,8 @@ Datum
 plv8_inline_handler(PG_FUNCTION_ARGS)
 {
 	InlineCodeBlock *codeblock = (InlineCodeBlock *) DatumGetPointer(PG_GETARG_DATUM(0));
+	plv8_spi_state *prev_spi = current_spi;
+	Datum			result;
 
 	Assert(IsA(codeblock, InlineCodeBlock));
 
@@ -710,83 +2067,366 @@ plv8_inline_handler(PG_FUNCTION_ARGS)
 		Persistent<Context> global_context;
 		global_context.Reset(current_context->isolate, current_context->context);
 
-		Local<Function>	function = CompileFunction(current_context,
-										NULL, 0, NULL,
-										source_text, false, false);
-		plv8_exec_env	   *xenv = CreateExecEnv(function, current_context);
-		return CallFunction(fcinfo, xenv, 0, NULL, NULL);
+		Local<Function>	function = CompileFunction(current_context,
+										NULL, 0, NULL,
+										source_text, false, false);
+		plv8_exec_env	   *xenv = CreateExecEnv(function, current_context);
+		result = CallFunction(fcinfo, xenv, 0, NULL, NULL);
+		current_spi = prev_spi;
+		return result;
+	}
+	catch (js_error& e)	{ current_spi = prev_spi; e.rethrow(); }
+	catch (pg_error& e)	{ current_spi = prev_spi; e.rethrow(); }
+
+	return (Datum) 0;	// keep compiler quiet
+}
+
+#endif
+
+typedef void (*plv8_sighandler)(int);
+
+static plv8_sighandler int_handler = NULL;
+static plv8_sighandler term_handler = NULL;
+static plv8_sighandler abt_handler = NULL;
+
+/*
+ * The context whose isolate is running JavaScript right now, or NULL.
+ * The signal handler consults this to decide whether to terminate JS.
+ */
+static plv8_context * volatile running_context = NULL;
+
+/*
+ * signal handler
+ *
+ * This function kills the execution of the v8 process if a signal is called
+ * while JavaScript is running, then passes the signal on to the handler
+ * that was installed before us.
+ */
+static void
+signal_handler (int sig) {
+	plv8_context   *running = running_context;
+	plv8_sighandler	handler = NULL;
+
+	if (running != NULL) {
+		running->interrupted = true;
+		running->isolate->TerminateExecution();
+	}
+
+	// call the old handler if it exists
+	switch(sig) {
+		case SIGINT:
+			handler = int_handler;
+			break;
+		case SIGTERM:
+			handler = term_handler;
+			break;
+		case SIGABRT:
+			handler = abt_handler;
+			/* outside of JS, keep the default action */
+			if (running == NULL && handler == SIG_DFL) {
+				signal(SIGABRT, SIG_DFL);
+				raise(SIGABRT);
+				return;
+			}
+			break;
+	}
+	if (handler != SIG_DFL && handler != SIG_IGN && handler != SIG_ERR)
+		handler(sig);
+}
+
+/*
+ * Install the interrupt signal handlers.  This is done once per backend,
+ * when the first context is created; afterwards entering and leaving JS
+ * only flips running_context.
+ */
+static void
+InstallSignalHandlers()
+{
+	static bool	installed = false;
+
+	if (installed)
+		return;
+
+	int_handler = signal(SIGINT, signal_handler);
+	term_handler = signal(SIGTERM, signal_handler);
+	abt_handler = signal(SIGABRT, signal_handler);
+	installed = true;
+}
+
+/*
+ * Watchdog.
+ *
+ * One thread per backend, started by the first call that has something to
+ * watch: statement_timeout is set or, with EXECUTION_TIMEOUT, always.  It
+ * sleeps until the outermost running call reaches one of its deadlines.
+ * Once the statement_timeout one has passed, it asks the isolate every
+ * WATCHDOG_POLL_MS to look at Postgres' interrupt flags, so that the
+ * timeout Postgres raises stops long-running JS; once the execution_timeout
+ * one has passed, it terminates the call.  Query cancel and backend
+ * termination are left to signal_handler.
+ *
+ * Arming and disarming are atomic stores.  The thread publishes when it
+ * will next wake up in watchdog_wake, and needs a notification only when a
+ * call must be looked at sooner than that.  Nested calls run under the
+ * deadlines of the outermost one, but the watched isolate follows the
+ * innermost call.
+ */
+#define WATCHDOG_POLL_MS		10
+#define WATCHDOG_DISARMED		0
+#define WATCHDOG_FIRED			(-1)
+#define WATCHDOG_NEVER			INT64_MAX
+
+/*
+ * Never destroyed: the thread may still be waiting on them at process
+ * exit, and destroying them then would hang.
+ */
+static std::mutex			   *watchdog_mutex = nullptr;
+static std::condition_variable *watchdog_cv = nullptr;
+static std::atomic<int64_t>		watchdog_deadline(WATCHDOG_DISARMED);
+static std::atomic<int64_t>		watchdog_poll(WATCHDOG_NEVER);
+static std::atomic<int64_t>		watchdog_wake(WATCHDOG_NEVER);
+static std::atomic<Isolate *>	watchdog_isolate(nullptr);
+static bool						watchdog_started = false;
+static int						watchdog_depth = 0;
+
+static inline int64_t
+WatchdogNow()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Runs in the main thread, at a point where V8 can safely stop JavaScript.
+ */
+static void
+WatchdogInterrupt(Isolate *isolate, void *data)
+{
+	if (!InterruptPending || !(QueryCancelPending || ProcDiePending))
+		return;
+
+	for (plv8_context *ctx : ContextVector)
+	{
+		if (ctx->isolate == isolate)
+			ctx->interrupted = true;
+	}
+	isolate->TerminateExecution();
+}
+
+static void
+WatchdogMain()
+{
+	std::unique_lock<std::mutex>	lock(*watchdog_mutex);
+
+	for (;;)
+	{
+		int64_t		deadline;
+		int64_t		wake;
+		int64_t		now;
+
+		/* Until the next wake-up is known, arming calls must notify us. */
+		watchdog_wake.store(WATCHDOG_NEVER);
+
+		deadline = watchdog_deadline.load();
+		if (deadline <= WATCHDOG_DISARMED)
+		{
+			watchdog_cv->wait(lock, [] { return watchdog_deadline.load() > WATCHDOG_DISARMED; });
+			continue;
+		}
+
+		now = WatchdogNow();
+		if (now >= deadline)
+		{
+			/* Fire, unless the call has finished or been re-armed meanwhile. */
+			if (watchdog_deadline.compare_exchange_strong(deadline, WATCHDOG_FIRED))
+				watchdog_isolate.load()->TerminateExecution();
+			continue;
+		}
+
+		wake = watchdog_poll.load();
+		if (now >= wake)
+		{
+			watchdog_isolate.load()->RequestInterrupt(WatchdogInterrupt, NULL);
+			wake = now + (int64_t) WATCHDOG_POLL_MS * 1000000;
+		}
+		wake = std::min(wake, deadline);
+		watchdog_wake.store(wake);
+		watchdog_cv->wait_for(lock, std::chrono::nanoseconds(wake - now));
+	}
+}
+
+static void
+StartWatchdog()
+{
+	bool		started = true;
+
+	if (watchdog_mutex == nullptr)
+	{
+		watchdog_mutex = new std::mutex();
+		watchdog_cv = new std::condition_variable();
+	}
+
+#ifndef WIN32
+	sigset_t	all, old;
+
+	/*
+	 * Postgres signals must keep being delivered to the main thread.  On
+	 * Windows they are emulated by Postgres itself and always are.
+	 */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+#endif
+	try
+	{
+		std::thread(WatchdogMain).detach();
+	}
+	catch (...)
+	{
+		started = false;
+	}
+#ifndef WIN32
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+#endif
+	if (!started)
+		throw js_error("could not start watchdog thread");
+	watchdog_started = true;
+}
+
+/*
+ * Start watching a call running in isolate.  Returns the isolate watched
+ * before, to be passed to WatchdogDisarm.
+ */
+static Isolate *
+WatchdogArm(Isolate *isolate)
+{
+	Isolate	   *prev = watchdog_isolate.exchange(isolate);
+	int64_t		deadline = WATCHDOG_NEVER;
+	int64_t		poll = WATCHDOG_NEVER;
+	int64_t		now;
+
+	if (watchdog_depth++ > 0)
+		return prev;
+
+#ifndef EXECUTION_TIMEOUT
+	if (StatementTimeout <= 0)
+		return prev;
+#endif
+	if (!watchdog_started)
+		StartWatchdog();
+
+	now = WatchdogNow();
+	if (StatementTimeout > 0)
+	{
+		/* Postgres started its timer when the statement started. */
+		int64_t		left = (int64_t) StatementTimeout * 1000 -
+			(GetCurrentTimestamp() - GetCurrentStatementStartTimestamp());
+
+		poll = now + std::max(left, (int64_t) 0) * 1000;
+	}
+#ifdef EXECUTION_TIMEOUT
+	deadline = now + (int64_t) plv8_execution_timeout * 1000000000;
+#endif
+	watchdog_poll.store(poll);
+	watchdog_deadline.store(deadline);
+	if (watchdog_wake.load() > std::min(poll, deadline))
+	{
+		std::lock_guard<std::mutex>	guard(*watchdog_mutex);
+		watchdog_cv->notify_one();
+	}
+	return prev;
+}
+
+/*
+ * Stop watching the current call.  Returns true if the deadline has passed
+ * and the watchdog terminated the execution.
+ */
+static bool
+WatchdogDisarm(Isolate *prev)
+{
+	if (watchdog_depth == 0)
+		return false;
+
+	if (--watchdog_depth > 0)
+	{
+		watchdog_isolate.store(prev);
+		return watchdog_deadline.load() == WATCHDOG_FIRED;
 	}
-	catch (js_error& e)	{ e.rethrow(); }
-	catch (pg_error& e)	{ e.rethrow(); }
 
-	return (Datum) 0;	// keep compiler quiet
+	if (watchdog_deadline.exchange(WATCHDOG_DISARMED) == WATCHDOG_FIRED)
+	{
+		/* Make sure the watchdog is done with the isolate. */
+		std::lock_guard<std::mutex>	guard(*watchdog_mutex);
+		return true;
+	}
+	return false;
 }
 
-#endif
+/*
+ * Wait until the watchdog no longer touches any isolate that is not
+ * running.  Must be called before disposing of an isolate.
+ */
+static void
+WatchdogSync()
+{
+	if (watchdog_mutex != nullptr)
+	{
+		std::lock_guard<std::mutex>	guard(*watchdog_mutex);
+	}
+}
 
-#ifdef EXECUTION_TIMEOUT
 /*
- * Breakout -- break out of a Call, with a thread
- *
- * This function breaks out of a javascript execution context.
+ * After a nested call has been stopped, make sure the outer call stops,
+ * too.
  */
-#ifdef _MSC_VER // windows
-DWORD WINAPI
-Breakout (LPVOID lpParam)
+static void
+WatchdogPropagate(bool interrupted)
 {
-	Isolate *isolate = (Isolate *) lpParam;
-	Sleep(plv8_execution_timeout * 1000);
-	isolate->TerminateExecution();
+	plv8_context   *outer = running_context;
 
-	return 0;
+	if (watchdog_depth == 0 || outer == NULL)
+		return;
+	if (interrupted)
+		outer->interrupted = true;
+	outer->isolate->TerminateExecution();
 }
-#else // posix
-void *
-Breakout (void *d)
-{
-	auto *isolate = (Isolate *) d;
-	sleep(plv8_execution_timeout);
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	isolate->TerminateExecution();
 
-	return NULL;
+static void
+WatchdogReset()
+{
+	watchdog_depth = 0;
+	watchdog_deadline.store(WATCHDOG_DISARMED);
 }
-#endif
-#endif
-void *int_handler = NULL;
-void *term_handler = NULL;
-void *abt_handler = NULL;
 
 /*
- * signal handler
- *
- * This function kills the execution of the v8 process if a signal is called
+ * Let Postgres raise the error for the interrupt that stopped JavaScript,
+ * so that cancel and statement_timeout report their usual messages.
  */
-void
-signal_handler (int sig) {
-	elog(DEBUG1, "cancelling execution");
-	auto running_context = GetPlv8Context();
-	running_context->interrupted = true;
-	running_context->isolate->TerminateExecution();
-
-	// call the old handler if it exists
-	switch(sig) {
-		case SIGINT:
-			if (int_handler != NULL) {
-				((void (*)(int)) int_handler)(sig);
-			}
-			break;
-		case SIGTERM:
-			if (term_handler != NULL) {
-				((void (*)(int)) term_handler)(sig);
-			}
-			break;
-		case SIGABRT:
-			if (abt_handler != NULL) {
-				((void (*)(int)) abt_handler)(sig);
-			}
-			break;
+static void
+ProcessPendingInterrupts()
+{
+	PG_TRY();
+	{
+		CHECK_FOR_INTERRUPTS();
+	}
+	PG_CATCH();
+	{
+		WatchdogPropagate(true);
+		throw pg_error();
 	}
+	PG_END_TRY();
+	WatchdogPropagate(true);
+}
+
+/*
+ * Forget about the running calls.  Used when an error is about to unwind
+ * them without going through DoCall.
+ */
+static void
+ResetCallState()
+{
+	running_context = NULL;
+	current_spi = NULL;
+	WatchdogReset();
 }
 
 /*
@@ -808,63 +2448,25 @@ DoCall(Local<Context> ctx, Handle<Function> fn, Handle<Object> receiver,
 		}
 	}
 
-#if PG_VERSION_NUM >= 110000
-	if (SPI_connect_ext(nonatomic ? SPI_OPT_NONATOMIC : 0) != SPI_OK_CONNECT)
-		throw js_error("could not connect to SPI manager");
-#else
-	if (SPI_connect() != SPI_OK_CONNECT)
-		throw js_error("could not connect to SPI manager");
-#endif
-
-	// set up the signal handlers
-	if (int_handler == NULL) {
-		int_handler = (void *) signal(SIGINT, signal_handler);
-	}
+	plv8_spi_state	spi = { false, nonatomic };
+	plv8_spi_state *prev_spi = current_spi;
 
-	if (term_handler == NULL) {
-		term_handler = (void *) signal(SIGTERM, signal_handler);
-	}
+	current_spi = &spi;
 
-	if (abt_handler == NULL) {
-		abt_handler = (void *) signal(SIGABRT, signal_handler);
-	}
+	plv8_context   *prev_running = running_context;
+	running_context = current_context;
 
-#ifdef EXECUTION_TIMEOUT
-	bool timeout = false;
-#ifdef _MSC_VER // windows
-	HANDLE  hThread;
-	DWORD dwThreadId;
-	hThread = CreateThread(NULL, 0, Breakout, isolate, 0, &dwThreadId);
-#else
-	pthread_t breakout_thread;
-	// set up the thread to break out the execution if needed
-	pthread_create(&breakout_thread, NULL, Breakout, isolate);
-#endif
-#endif
+	Isolate	   *prev_watched = WatchdogArm(isolate);
 
 	try {
 	MaybeLocal<v8::Value> result = fn->Call(ctx, receiver, nargs, args);
-	int	status = SPI_finish();
-
-#ifdef EXECUTION_TIMEOUT
-#ifdef _MSC_VER
-	if (TerminateThread(hThread, NULL) == 0) {
-		timeout = true;
-	}
-#else
-	void *thread_result;
-	pthread_cancel(breakout_thread);
-	pthread_join(breakout_thread, &thread_result);
-	if (thread_result == NULL) {
-		timeout = true;
-	}
-#endif
-#endif
+	int	status = 0;
+	bool		timeout = WatchdogDisarm(prev_watched);
 
-	// reset signal handlers
-	signal(SIGINT, (void (*)(int)) int_handler);
-	signal(SIGTERM, (void (*)(int)) term_handler);
-	signal(SIGABRT, (void (*)(int)) abt_handler);
+	running_context = prev_running;
+	current_spi = prev_spi;
+	if (spi.connected)
+		status = SPI_finish();
 
 	HandleUnhandledPromiseRejections();
 
@@ -873,13 +2475,13 @@ DoCall(Local<Context> ctx, Handle<Function> fn, Handle<Object> receiver,
 			isolate->CancelTerminateExecution();
 			if (current_context->interrupted) {
 				current_context->interrupted = false;
+				ProcessPendingInterrupts();
 				throw js_error("Signal caught: interrupted");
 			}
-#ifdef EXECUTION_TIMEOUT
 			if (timeout) {
+				WatchdogPropagate(false);
 				throw js_error("execution timeout exceeded");
 			}
-#endif
 			throw js_error("Out of memory error");
 		}
 		throw js_error(try_catch);
@@ -896,6 +2498,29 @@ DoCall(Local<Context> ctx, Handle<Function> fn, Handle<Object> receiver,
 	return Local<v8::Value>::New(isolate, Null(isolate));
 }
 
+/*
+ * EnsureSPIConnected -- connect to SPI for the running call, if not yet.
+ *
+ * Builtins that use SPI must call this before doing so, and outside of
+ * any subtransaction they start, since SPI connections opened inside a
+ * subtransaction are torn down when it ends.
+ */
+void
+EnsureSPIConnected()
+{
+	if (current_spi == NULL || current_spi->connected)
+		return;
+
+#if PG_VERSION_NUM >= 110000
+	if (SPI_connect_ext(current_spi->nonatomic ? SPI_OPT_NONATOMIC : 0) != SPI_OK_CONNECT)
+		throw js_error("could not connect to SPI manager");
+#else
+	if (SPI_connect() != SPI_OK_CONNECT)
+		throw js_error("could not connect to SPI manager");
+#endif
+	current_spi->connected = true;
+}
+
 static Datum
 CallFunction(PG_FUNCTION_ARGS, plv8_exec_env *xenv,
 	int nargs, plv8_type argtypes[], plv8_type *rettype)
@@ -953,7 +2578,7 @@ CallFunction(PG_FUNCTION_ARGS, plv8_exec_env *xenv,
 }
 
 static Tuplestorestate *
-CreateTupleStore(PG_FUNCTION_ARGS, TupleDesc *tupdesc)
+CreateTupleStore(PG_FUNCTION_ARGS, TupleDesc *tupdesc, TypeFuncClass *functypclass)
 {
 	Tuplestorestate	   *tupstore;
 
@@ -962,7 +2587,7 @@ CreateTupleStore(PG_FUNCTION_ARGS, TupleDesc *tupdesc)
 		ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 		MemoryContext	per_query_ctx;
 		MemoryContext	oldcontext;
-		plv8_proc	   *proc = (plv8_proc *) fcinfo->flinfo->fn_extra;
+		plv8_proc	   *proc = ((plv8_call_site *) fcinfo->flinfo->fn_extra)->proc;
 
 		/* check to see if caller supports us returning a tuplestore */
 		if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
@@ -975,8 +2600,8 @@ CreateTupleStore(PG_FUNCTION_ARGS, TupleDesc *tupdesc)
 					 errmsg("materialize mode required, but it is not " \
 							"allowed in this context")));
 
-		if (!proc->functypclass)
-			proc->functypclass = get_call_result_type(fcinfo, NULL, NULL);
+		/* This depends on the call site, so it isn't cached with proc. */
+		*functypclass = get_call_result_type(fcinfo, NULL, NULL);
 
 		per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
 		oldcontext = MemoryContextSwitchTo(per_query_ctx);
@@ -987,7 +2612,7 @@ CreateTupleStore(PG_FUNCTION_ARGS, TupleDesc *tupdesc)
 		/* Build a tuple descriptor for our result type */
 		if (proc->rettype.typid == RECORDOID)
 		{
-			if (proc->functypclass != TYPEFUNC_COMPOSITE)
+			if (*functypclass != TYPEFUNC_COMPOSITE)
 				ereport(ERROR,
 						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
 						 errmsg("function returning record called in context "
@@ -1016,8 +2641,8 @@ static Datum
 CallSRFunction(PG_FUNCTION_ARGS, plv8_exec_env *xenv,
 	int nargs, plv8_type argtypes[], plv8_type *rettype)
 {
-	plv8_proc		   *proc = (plv8_proc *) fcinfo->flinfo->fn_extra;
 	TupleDesc			tupdesc;
+	TypeFuncClass		functypclass;
 	Tuplestorestate	   *tupstore;
 
 #if PG_VERSION_NUM >= 110000
@@ -1028,11 +2653,11 @@ CallSRFunction(PG_FUNCTION_ARGS, plv8_exec_env *xenv,
   bool nonatomic = false;
 #endif
 
-	tupstore = CreateTupleStore(fcinfo, &tupdesc);
+	tupstore = CreateTupleStore(fcinfo, &tupdesc, &functypclass);
 
 	Handle<Context>		context = xenv->localContext();
 	Context::Scope		context_scope(context);
-	Converter			conv(tupdesc, proc->functypclass == TYPEFUNC_SCALAR);
+	Converter			conv(tupdesc, functypclass == TYPEFUNC_SCALAR);
 	Handle<v8::Value>	args[FUNC_MAX_ARGS + 1];
 
 	/*
@@ -1277,7 +2902,7 @@ plv8_call_validator(PG_FUNCTION_ARGS)
 		/* Don't use validator's fcinfo */
 		plv8_proc	   *proc = Compile(fn_oid, NULL,
 									   true, is_trigger);
-		(void) CreateExecEnv(proc->cache->function, current_context);
+		(void) GetExecEnv(proc->cache, current_context);
 		/* the result of a validator is ignored */
 		PG_RETURN_VOID();
 	}
@@ -1291,37 +2916,31 @@ static plv8_proc *
 plv8_get_proc(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, char ***argnames) throw()
 {
 	HeapTuple			procTup;
+	plv8_proc_cache_entry *entry;
 	plv8_proc_cache	   *cache;
-	bool				found;
+	plv8_proc_key		key;
 	bool				isnull;
 	Datum				prosrc;
 	Oid				   *argtypes;
 	char			   *argmodes;
 	MemoryContext		oldcontext;
 
-	procTup = SearchSysCache(PROCOID, ObjectIdGetDatum(fn_oid), 0, 0, 0);
-	if (!HeapTupleIsValid(procTup))
-		elog(ERROR, "cache lookup failed for function %u", fn_oid);
-
-	cache = (plv8_proc_cache *)
-		hash_search(plv8_proc_cache_hash,&fn_oid, HASH_ENTER, &found);
+	/*
+	 * The V8 function is associated with the context where it was
+	 * generated, so functions are cached per user.
+	 */
+	key.fn_oid = fn_oid;
+	key.user_id = GetUserId();
+	entry = (plv8_proc_cache_entry *)
+		hash_search(plv8_proc_cache_hash, &key, HASH_FIND, NULL);
 
-	if (found)
+	if (entry)
 	{
-		bool	uptodate;
+		cache = entry->cache;
+		dlist_move_head(&plv8_proc_lru, &cache->lru_node);
 
-		/*
-		 * We need to check user id and dispose it if it's different from
-		 * the previous cache user id, as the V8 function is associated
-		 * with the context where it was generated.  In most cases,
-		 * we can expect this doesn't affect runtime performance.
-		 */
-		uptodate = (!cache->function.IsEmpty() &&
-			cache->fn_xmin == HeapTupleHeaderGetXmin(procTup->t_data) &&
-			ItemPointerEquals(&cache->fn_tid, &procTup->t_self) &&
-			cache->user_id == GetUserId());
-
-		if (!uptodate)
+		/* Changes to the function itself are tracked by plv8_syscache_cb. */
+		if (cache->function.IsEmpty() || !cache->valid)
 		{
 			if (cache->prosrc)
 			{
@@ -1329,22 +2948,37 @@ plv8_get_proc(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, char ***argnam
 				cache->prosrc = NULL;
 			}
 			cache->function.Reset();
-		}
-		else
-		{
-			ReleaseSysCache(procTup);
+			plv8_clear_exec_env(cache->xenv);
+			plv8_drop_procs(cache);
 		}
 	}
 	else
 	{
+		cache = (plv8_proc_cache *)
+			MemoryContextAllocZero(TopMemoryContext, sizeof(plv8_proc_cache));
 		new(&cache->function) Persistent<Function>();
-		cache->prosrc = NULL;
+		cache->fn_oid = fn_oid;
+		cache->user_id = key.user_id;
+		cache->xenv = plv8_alloc_exec_env(TopMemoryContext);
+
+		entry = (plv8_proc_cache_entry *)
+			hash_search(plv8_proc_cache_hash, &key, HASH_ENTER, NULL);
+		entry->cache = cache;
+		dlist_push_head(&plv8_proc_lru, &cache->lru_node);
+
+		while (hash_get_num_entries(plv8_proc_cache_hash) > plv8_function_cache_size)
+			plv8_evict_proc_cache(dlist_container(plv8_proc_cache, lru_node,
+												  dlist_tail_node(&plv8_proc_lru)));
 	}
 
 	if (cache->function.IsEmpty())
 	{
 		Form_pg_proc	procStruct;
 
+		procTup = SearchSysCache(PROCOID, ObjectIdGetDatum(fn_oid), 0, 0, 0);
+		if (!HeapTupleIsValid(procTup))
+			elog(ERROR, "cache lookup failed for function %u", fn_oid);
+
 		procStruct = (Form_pg_proc) GETSTRUCT(procTup);
 
 		prosrc = SysCacheGetAttr(PROCOID, procTup, Anum_pg_proc_prosrc, &isnull);
@@ -1355,9 +2989,7 @@ plv8_get_proc(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, char ***argnam
 		cache->rettype = procStruct->prorettype;
 
 		strlcpy(cache->proname, NameStr(procStruct->proname), NAMEDATALEN);
-		cache->fn_xmin = HeapTupleHeaderGetXmin(procTup->t_data);
-		cache->fn_tid = procTup->t_self;
-		cache->user_id = GetUserId();
+		cache->valid = true;
 
 		int nargs = get_func_arg_info(procTup, &argtypes, argnames, &argmodes);
 
@@ -1410,35 +3042,102 @@ plv8_get_proc(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, char ***argnam
 		cache->nargs = inargs;
 	}
 
+	Oid		argtypids[FUNC_MAX_ARGS];
+	Oid		rettypid = cache->rettype;
+	bool	polymorphic = IsPolymorphicType(rettypid);
+
+	/* Resolve polymorphic types, if this is an actual call context. */
+	if (fcinfo && polymorphic)
+		rettypid = get_fn_expr_rettype(fcinfo->flinfo);
+	for (int i = 0; i < cache->nargs; i++)
+	{
+		argtypids[i] = cache->argtypes[i];
+		if (IsPolymorphicType(argtypids[i]))
+		{
+			polymorphic = true;
+			if (fcinfo)
+				argtypids[i] = get_fn_expr_argtype(fcinfo->flinfo, i);
+		}
+	}
+
+	plv8_proc **link = &cache->procs;
+	while (*link)
+	{
+		plv8_proc	   *proc = *link;
+
+		if (proc->stale)
+		{
+			*link = proc->next;
+			plv8_retire_proc(proc);
+			continue;
+		}
+		if (proc->rettypid == rettypid &&
+			memcmp(proc->argtypids, argtypids, sizeof(Oid) * cache->nargs) == 0)
+			return proc;
+		link = &proc->next;
+	}
+
+	/*
+	 * Unresolved polymorphic types are only good for validation; don't
+	 * cache those.  A cached descriptor is built in a child of the current
+	 * context, so it goes away on error, and moved under TopMemoryContext
+	 * once complete.
+	 */
+	bool	cacheable = (fcinfo != NULL || !polymorphic);
 	MemoryContext mcxt = CurrentMemoryContext;
-	if (fcinfo)
-		mcxt = fcinfo->flinfo->fn_mcxt;
+	if (cacheable)
+	{
+#if PG_VERSION_NUM < 110000
+		mcxt = AllocSetContextCreate(CurrentMemoryContext,
+									 "PLv8 Procedure Context",
+									 ALLOCSET_SMALL_MINSIZE,
+									 ALLOCSET_SMALL_INITSIZE,
+									 ALLOCSET_SMALL_MAXSIZE);
+#else
+		mcxt = AllocSetContextCreate(CurrentMemoryContext,
+									 "PLv8 Procedure Context",
+									 ALLOCSET_SMALL_SIZES);
+#endif
+	}
 
 	plv8_proc *proc = (plv8_proc *) MemoryContextAllocZero(mcxt,
 		offsetof(plv8_proc, argtypes) + sizeof(plv8_type) * cache->nargs);
 
 	proc->cache = cache;
+	proc->rettypid = rettypid;
+	memcpy(proc->argtypids, argtypids, sizeof(Oid) * cache->nargs);
 	for (int i = 0; i < cache->nargs; i++)
+		plv8_fill_type(&proc->argtypes[i], argtypids[i], mcxt);
+	plv8_fill_type(&proc->rettype, rettypid, mcxt);
+
+	if (cacheable)
 	{
-		Oid		argtype = cache->argtypes[i];
-		/* Resolve polymorphic types, if this is an actual call context. */
-		if (fcinfo && IsPolymorphicType(argtype))
-			argtype = get_fn_expr_argtype(fcinfo->flinfo, i);
-		plv8_fill_type(&proc->argtypes[i], argtype, mcxt);
+		MemoryContextSetParent(mcxt, TopMemoryContext);
+		proc->mcxt = mcxt;
+		proc->next = cache->procs;
+		cache->procs = proc;
 	}
 
-	Oid		rettype = cache->rettype;
-	/* Resolve polymorphic return type if this is an actual call context. */
-	if (fcinfo && IsPolymorphicType(rettype))
-		rettype = get_fn_expr_rettype(fcinfo->flinfo);
-	plv8_fill_type(&proc->rettype, rettype, mcxt);
-
 	return proc;
 }
 
+static void
+InitExecEnv(plv8_exec_env *xenv, Handle<Function> function, plv8_context *context)
+{
+	xenv->context.Reset(context->isolate, context->context);
+	Local<Context>		ctx = xenv->localContext();
+	Context::Scope		scope(ctx);
+
+	Local<ObjectTemplate> templ = Local<ObjectTemplate>::New(context->isolate, context->recv_templ);
+	Local<Object> obj = templ->NewInstance(ctx).ToLocalChecked();
+	obj->SetInternalField(0, function);
+	xenv->recv.Reset(context->isolate, obj);
+}
+
 static plv8_exec_env *
-CreateExecEnv(Persistent<Function>& function, plv8_context *context)
+CreateExecEnv(Handle<Function> function, plv8_context *context)
 {
+	Isolate::Scope	    iscope(context->isolate);
 	plv8_exec_env	   *xenv;
 	HandleScope			handle_scope(context->isolate);
 
@@ -1452,100 +3151,296 @@ CreateExecEnv(Persistent<Function>& function, plv8_context *context)
 	}
 	PG_END_TRY();
 
-	xenv->context.Reset(context->isolate, context->context);
-	Local<Context>		ctx = xenv->localContext();
-	Context::Scope		scope(ctx);
+	InitExecEnv(xenv, function, context);
 
-	Local<ObjectTemplate> templ = Local<ObjectTemplate>::New(context->isolate, context->recv_templ);
-	Local<Object> obj = templ->NewInstance(ctx).ToLocalChecked();
-	Local<Function> f = Local<Function>::New(context->isolate, function);
-	obj->SetInternalField(0, f);
-	xenv->recv.Reset(context->isolate, obj);
+	return xenv;
+}
 
+/*
+ * Returns the exec env of a compiled function, creating its receiver on
+ * first use after the function was (re)compiled.
+ */
+static plv8_exec_env *
+GetExecEnv(plv8_proc_cache *cache, plv8_context *context)
+{
+	plv8_exec_env	   *xenv = cache->xenv;
+
+	if (xenv->recv.IsEmpty())
+	{
+		HandleScope			handle_scope(context->isolate);
+
+		xenv->isolate = context->isolate;
+		InitExecEnv(xenv, Local<Function>::New(context->isolate, cache->function), context);
+	}
 
 	return xenv;
 }
 
-static plv8_exec_env *
-CreateExecEnv(Handle<Function> function, plv8_context *context)
+/*
+ * fcinfo should be passed if this is an actual function call context, where
+ * we can resolve polymorphic types and use function's memory context.
+ */
+static plv8_proc *
+Compile(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, bool is_trigger)
 {
-	Isolate::Scope	    iscope(context->isolate);
-	plv8_exec_env	   *xenv;
-	HandleScope			handle_scope(context->isolate);
+	plv8_proc  *proc;
+	char	  **argnames;
 
 	PG_TRY();
 	{
-		xenv = plv8_new_exec_env(context->isolate);
+		proc = plv8_get_proc(fn_oid, fcinfo, validate, &argnames);
 	}
 	PG_CATCH();
 	{
 		throw pg_error();
 	}
-	PG_END_TRY();
+	PG_END_TRY();
+
+	plv8_proc_cache *cache = proc->cache;
+
+	if (cache->function.IsEmpty())
+	{
+		/*
+		 * We need to create global context before entering CompileFunction
+		 * because GetPlv8Context could call startup procedure, which
+		 * could be this cache->function itself.  In this scenario,
+		 * Compile is called recursively and plv8_get_proc tries to refresh
+		 * cache because cache->function is still not yet ready at this
+		 * point.  Then some pointers of cache will become stale by pfree
+		 * and CompileFunction ends up compiling freed function source.
+		 */
+		current_context = GetPlv8Context();
+		Isolate::Scope	scope(current_context->isolate);
+		HandleScope		handle_scope(current_context->isolate);
+		Persistent<Context>	global_context;
+		global_context.Reset(current_context->isolate, current_context->context);
+		cache->function.Reset(current_context->isolate, CompileFunction(
+						current_context,
+						cache->proname,
+						cache->nargs,
+						(const char **) argnames,
+						cache->prosrc,
+						is_trigger,
+						cache->retset));
+	}
+
+	return proc;
+}
+
+/*
+ * Code cache.
+ *
+ * With plv8.code_cache on, the V8 code cache of each compiled function is
+ * kept in a file named after a hash of the V8 version and flags and of the
+ * function's argument names and source, so that new backends skip parsing and compiling
+ * functions seen before.  V8 validates the data itself; rejected data is
+ * replaced with fresh one.  Files that are no longer looked up, because the
+ * function was replaced or dropped or V8 was upgraded, are removed once
+ * the directory outgrows plv8.code_cache_size.
+ */
+typedef struct plv8_code_cache_file
+{
+	char		name[MAXPGPATH];
+	time_t		mtime;
+	off_t		size;
+} plv8_code_cache_file;
+
+/* Bytes in the code cache directory as far as this backend knows, or -1 */
+static int64 code_cache_bytes = -1;
+static uint64
+plv8_hash_bytes(const char *data, int len, uint64 seed)
+{
+#if PG_VERSION_NUM >= 110000
+	return DatumGetUInt64(hash_any_extended((const unsigned char *) data, len, seed));
+#else
+	uint32		h = DatumGetUInt32(hash_any((const unsigned char *) data, len));
+
+	return ((uint64) DatumGetUInt32(hash_uint32(h ^ (uint32) seed)) << 32) | h;
+#endif
+}
+
+static void
+plv8_code_cache_path(char *path, int argc, const char *argv[], const char *src)
+{
+	StringInfoData	key;
+
+	initStringInfo(&key);
+	appendStringInfo(&key, "%s\n%s%s\n", V8::GetVersion(),
+					 plv8_v8_flags ? plv8_v8_flags : "",
+					 plv8_jitless ? " --jitless" : "");
+	for (int i = 0; i < argc; i++)
+		appendStringInfo(&key, "%s,", argv[i]);
+	appendStringInfo(&key, "\n%s", src);
+	snprintf(path, MAXPGPATH,
+			 PLV8_CODE_CACHE_DIR "/%016" INT64_MODIFIER "x%016" INT64_MODIFIER "x",
+			 plv8_hash_bytes(key.data, key.len, 0),
+			 plv8_hash_bytes(key.data, key.len, UINT64CONST(0x9e3779b97f4a7c15)));
+	pfree(key.data);
+}
+
+/*
+ * Returns the contents of a code cache file, or NULL if there is none.
+ */
+static char *
+plv8_code_cache_read(const char *path, int *len)
+{
+	FILE	   *file;
+	struct stat	st;
+	char	   *data;
+
+	file = AllocateFile(path, PG_BINARY_R);
+	if (file == NULL)
+		return NULL;
+
+	if (fstat(fileno(file), &st) < 0 || st.st_size == 0 ||
+		st.st_size > (off_t) MaxAllocSize)
+	{
+		FreeFile(file);
+		return NULL;
+	}
+
+	data = (char *) palloc(st.st_size);
+	if (fread(data, 1, st.st_size, file) != (size_t) st.st_size)
+	{
+		pfree(data);
+		FreeFile(file);
+		return NULL;
+	}
+	FreeFile(file);
+
+	/* Refresh the file's place in the LRU order, at most once a minute. */
+	if (st.st_mtime < time(NULL) - 60)
+		(void) utime(path, NULL);
+
+	*len = (int) st.st_size;
+	return data;
+}
+
+static int
+plv8_code_cache_file_cmp(const void *a, const void *b)
+{
+	time_t		ta = ((const plv8_code_cache_file *) a)->mtime;
+	time_t		tb = ((const plv8_code_cache_file *) b)->mtime;
+
+	return ta < tb ? -1 : ta > tb ? 1 : 0;
+}
+
+/*
+ * Keeps the code cache directory under plv8.code_cache_size, after len
+ * bytes have been added to it, by removing the least recently used files
+ * until it is a tenth below the limit.  The directory is only scanned
+ * once what this backend knows of it exceeds the limit, so other backends
+ * may push it a little over until then.
+ */
+static void
+plv8_code_cache_trim(int len)
+{
+	int64		limit = (int64) plv8_code_cache_size * 1024;
+	plv8_code_cache_file *files;
+	int			nfiles = 0;
+	int			maxfiles = 64;
+	int64		total = 0;
+	DIR		   *dir;
+	struct dirent *de;
+
+	if (limit == 0)
+		return;
+	if (code_cache_bytes >= 0)
+	{
+		code_cache_bytes += len;
+		if (code_cache_bytes <= limit)
+			return;
+	}
 
-	xenv->context.Reset(context->isolate, context->context);
-	Local<Context>		ctx = xenv->localContext();
-	Context::Scope		scope(ctx);
+	dir = AllocateDir(PLV8_CODE_CACHE_DIR);
+	if (dir == NULL)
+		return;
 
-	Local<ObjectTemplate> templ = Local<ObjectTemplate>::New(context->isolate, context->recv_templ);
-	Local<Object> obj = templ->NewInstance(ctx).ToLocalChecked();
-	Local<Function> f = Local<Function>::New(context->isolate, function);
-	obj->SetInternalField(0, f);
-	xenv->recv.Reset(context->isolate, obj);
+	files = (plv8_code_cache_file *) palloc(sizeof(plv8_code_cache_file) * maxfiles);
+	while ((de = ReadDir(dir, PLV8_CODE_CACHE_DIR)) != NULL)
+	{
+		plv8_code_cache_file *file;
+		struct stat	st;
 
+		/* skip . and .., and files still being written */
+		if (de->d_name[0] == '.' || strstr(de->d_name, ".tmp") != NULL)
+			continue;
 
-	return xenv;
+		if (nfiles == maxfiles)
+		{
+			maxfiles *= 2;
+			files = (plv8_code_cache_file *) repalloc(files, sizeof(plv8_code_cache_file) * maxfiles);
+		}
+		file = &files[nfiles];
+		snprintf(file->name, MAXPGPATH, PLV8_CODE_CACHE_DIR "/%s", de->d_name);
+		if (stat(file->name, &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+		file->mtime = st.st_mtime;
+		file->size = st.st_size;
+		total += st.st_size;
+		nfiles++;
+	}
+	FreeDir(dir);
+
+	if (total > limit)
+	{
+		qsort(files, nfiles, sizeof(plv8_code_cache_file), plv8_code_cache_file_cmp);
+		for (int i = 0; i < nfiles && total > limit - limit / 10; i++)
+		{
+			/* another backend may have removed it already */
+			if (unlink(files[i].name) == 0 || errno == ENOENT)
+				total -= files[i].size;
+		}
+	}
+	pfree(files);
+	code_cache_bytes = total;
 }
 
 /*
- * fcinfo should be passed if this is an actual function call context, where
- * we can resolve polymorphic types and use function's memory context.
+ * Writes a code cache file.  Failures are reported, but don't fail the
+ * function call.  The data is written to a temporary file first, so that
+ * concurrent readers never see a partial file.
  */
-static plv8_proc *
-Compile(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, bool is_trigger)
+static void
+plv8_code_cache_write(const char *path, const uint8_t *data, int len)
 {
-	plv8_proc  *proc;
-	char	  **argnames;
+	char		tmppath[MAXPGPATH];
+	char		dir[MAXPGPATH] = PLV8_CODE_CACHE_DIR;
+	FILE	   *file;
 
-	PG_TRY();
+	snprintf(tmppath, MAXPGPATH, "%s.%d.tmp", path, MyProcPid);
+
+	file = AllocateFile(tmppath, PG_BINARY_W);
+	if (file == NULL && errno == ENOENT && pg_mkdir_p(dir, S_IRWXU) == 0)
+		file = AllocateFile(tmppath, PG_BINARY_W);
+	if (file == NULL)
 	{
-		proc = plv8_get_proc(fn_oid, fcinfo, validate, &argnames);
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not create code cache file \"%s\": %m", tmppath)));
+		return;
 	}
-	PG_CATCH();
+
+	if (fwrite(data, 1, len, file) != (size_t) len)
 	{
-		throw pg_error();
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not write code cache file \"%s\": %m", tmppath)));
+		FreeFile(file);
+		unlink(tmppath);
+		return;
 	}
-	PG_END_TRY();
 
-	plv8_proc_cache *cache = proc->cache;
-
-	if (cache->function.IsEmpty())
+	if (FreeFile(file) != 0 || rename(tmppath, path) != 0)
 	{
-		/*
-		 * We need to create global context before entering CompileFunction
-		 * because GetPlv8Context could call startup procedure, which
-		 * could be this cache->function itself.  In this scenario,
-		 * Compile is called recursively and plv8_get_proc tries to refresh
-		 * cache because cache->function is still not yet ready at this
-		 * point.  Then some pointers of cache will become stale by pfree
-		 * and CompileFunction ends up compiling freed function source.
-		 */
-		current_context = GetPlv8Context();
-		Isolate::Scope	scope(current_context->isolate);
-		HandleScope		handle_scope(current_context->isolate);
-		Persistent<Context>	global_context;
-		global_context.Reset(current_context->isolate, current_context->context);
-		cache->function.Reset(current_context->isolate, CompileFunction(
-						current_context,
-						cache->proname,
-						cache->nargs,
-						(const char **) argnames,
-						cache->prosrc,
-						is_trigger,
-						cache->retset));
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not write code cache file \"%s\": %m", path)));
+		unlink(tmppath);
+		return;
 	}
 
-	return proc;
+	plv8_code_cache_trim(len);
 }
 
 static Local<Function>
@@ -1560,99 +3455,130 @@ CompileFunction(
 {
 	Isolate					   *isolate = Isolate::GetCurrent();
 	EscapableHandleScope		handle_scope(isolate);
-	StringInfoData	src;
-
-	initStringInfo(&src);
+	static const char		   *trigger_args[] = {
+		"NEW", "OLD", "TG_NAME", "TG_WHEN", "TG_LEVEL", "TG_OP",
+		"TG_RELID", "TG_TABLE_NAME", "TG_TABLE_SCHEMA", "TG_ARGV"
+	};
+	const char				   *argnames[FUNC_MAX_ARGS];
+	char						unnamed[FUNC_MAX_ARGS][16];
+	Local<v8::String>			args[FUNC_MAX_ARGS];
+	int							argc;
 
-	appendStringInfo(&src, "(function (");
 	if (is_trigger)
 	{
 		if (proarglen != 0)
 			throw js_error("trigger function cannot have arguments");
 		// trigger function has special arguments.
-		appendStringInfo(&src,
-			"NEW, OLD, TG_NAME, TG_WHEN, TG_LEVEL, TG_OP, "
-			"TG_RELID, TG_TABLE_NAME, TG_TABLE_SCHEMA, TG_ARGV");
+		argc = lengthof(trigger_args);
+		for (int i = 0; i < argc; i++)
+			argnames[i] = trigger_args[i];
 	}
 	else
 	{
-		for (int i = 0; i < proarglen; i++)
+		argc = proarglen;
+		for (int i = 0; i < argc; i++)
 		{
-			if (i > 0)
-				appendStringInfoChar(&src, ',');
-			if (proargs && proargs[i])
-				appendStringInfoString(&src, proargs[i]);
+			if (proargs && proargs[i] && proargs[i][0])
+				argnames[i] = proargs[i];
 			else
-				appendStringInfo(&src, "$%d", i + 1);	// unnamed argument to $N
+			{
+				// unnamed argument to $N
+				snprintf(unnamed[i], sizeof(unnamed[i]), "$%d", i + 1);
+				argnames[i] = unnamed[i];
+			}
 		}
 	}
 
-	appendStringInfo(&src, "){\n%s\n})", prosrc);
+	/* Inline code blocks are compiled once; don't cache them. */
+	bool		use_code_cache = plv8_code_cache && proname != NULL &&
+		!global_context->building_snapshot;
+	char		cache_path[MAXPGPATH];
+	char	   *cache_data = NULL;
+	int			cache_len = 0;
+
+	if (use_code_cache)
+	{
+		PG_TRY();
+		{
+			plv8_code_cache_path(cache_path, argc, argnames, prosrc);
+			cache_data = plv8_code_cache_read(cache_path, &cache_len);
+		}
+		PG_CATCH();
+		{
+			throw pg_error();
+		}
+		PG_END_TRY();
+	}
 
 	Handle<v8::Value> name;
 	if (proname)
 		name = ToString(proname);
 	else
 		name = Undefined(isolate);
-	Local<v8::String> source = ToString(src.data, src.len);
-	pfree(src.data);
+	for (int i = 0; i < argc; i++)
+		args[i] = ToString(argnames[i]);
+	Local<v8::String> source = ToString(prosrc);
 
 	Local<Context> context = Local<Context>::New(isolate, global_context->context);
 	Context::Scope	context_scope(context);
 	TryCatch		try_catch(isolate);
 	v8::ScriptOrigin origin(isolate, name);
+	ScriptCompiler::CachedData *cached = NULL;
 
-	// set up the signal handlers
-	if (int_handler == NULL) {
-		int_handler = (void *) signal(SIGINT, signal_handler);
-	}
-
-	if (term_handler == NULL) {
-		term_handler = (void *) signal(SIGTERM, signal_handler);
-	}
-
-#ifdef EXECUTION_TIMEOUT
-	bool timeout = false;
-#ifdef _MSC_VER // windows
-	HANDLE  hThread;
-	DWORD dwThreadId;
-	hThread = CreateThread(NULL, 0, Breakout, isolate, 0, &dwThreadId);
-#else
-	pthread_t breakout_thread;
-	// set up the thread to break out the execution if needed
-	pthread_create(&breakout_thread, NULL, Breakout, isolate);
-#endif
-#endif
+	if (cache_data)
+		cached = new ScriptCompiler::CachedData((const uint8_t *) cache_data, cache_len,
+												ScriptCompiler::CachedData::BufferNotOwned);
 
-	v8::Local<v8::Script> script;
-	v8::Local<v8::Value> result;
+	/* script_source owns cached */
+	ScriptCompiler::Source	script_source(source, origin, cached);
+	v8::Local<v8::Function> result;
 	if (current_context->interrupted) {
 		isolate->CancelTerminateExecution();
 		current_context->interrupted = false;
 	}
-	if (Script::Compile(isolate->GetCurrentContext(), source, &origin).ToLocal(&script)) {
-		if (!script.IsEmpty()) {
-			if (!script->Run(isolate->GetCurrentContext()).ToLocal(&result))
-				throw js_error(try_catch);
-		}
-	}
 
-#ifdef EXECUTION_TIMEOUT
-#ifdef _MSC_VER
-	if (TerminateThread(hThread, NULL) == 0) {
-		timeout = true;
-	}
-#else
-	void *thread_result;
-	pthread_cancel(breakout_thread);
-	pthread_join(breakout_thread, &thread_result);
-	if (thread_result == NULL) {
-		timeout = true;
+	plv8_context   *prev_running = running_context;
+	running_context = current_context;
+
+	Isolate	   *prev_watched = WatchdogArm(isolate);
+
+	(void) ScriptCompiler::CompileFunction(isolate->GetCurrentContext(),
+			&script_source, argc, args, 0, NULL,
+			cached ? ScriptCompiler::kConsumeCodeCache : ScriptCompiler::kNoCompileOptions).ToLocal(&result);
+
+	bool		timeout = WatchdogDisarm(prev_watched);
+	running_context = prev_running;
+
+	if (use_code_cache)
+	{
+		bool	rejected = cached && cached->rejected;
+
+		if (cached == NULL)
+			global_context->code_cache_misses++;
+		else if (rejected)
+			global_context->code_cache_rejects++;
+		else
+			global_context->code_cache_hits++;
+
+		if ((cached == NULL || rejected) && !result.IsEmpty())
+		{
+			std::unique_ptr<ScriptCompiler::CachedData> data(
+				ScriptCompiler::CreateCodeCacheForFunction(result));
+
+			PG_TRY();
+			{
+				if (data)
+					plv8_code_cache_write(cache_path, data->data, data->length);
+			}
+			PG_CATCH();
+			{
+				throw pg_error();
+			}
+			PG_END_TRY();
+		}
+		if (cache_data)
+			pfree(cache_data);
 	}
-#endif
-#endif
-	signal(SIGINT, (void (*)(int)) int_handler);
-	signal(SIGTERM, (void (*)(int)) term_handler);
 
 	HandleUnhandledPromiseRejections();
 
@@ -1661,19 +3587,19 @@ CompileFunction(
 			isolate->CancelTerminateExecution();
 			if (current_context->interrupted) {
 				current_context->interrupted = false;
+				ProcessPendingInterrupts();
 				throw js_error("Signal caught: interrupted");
 			}
-#ifdef EXECUTION_TIMEOUT
 			if (timeout) {
+				WatchdogPropagate(false);
 				throw js_error("compiler timeout exceeded");
 			}
-#endif
 			throw js_error("Script is out of memory");
 		}
 		throw js_error(try_catch);
 	}
 
-	return handle_scope.Escape(Local<Function>::Cast(result));
+	return handle_scope.Escape(result);
 }
 
 Local<Function>
@@ -1790,25 +3716,188 @@ charToText(char *string)
 	return result;
 }
 
+/*
+ * Sets up the templates of a new plv8 context.
+ * The caller must have entered the isolate and opened a handle scope.
+ */
+static void
+InitContextTemplates(plv8_context *context)
+{
+	Isolate				   *isolate = context->isolate;
+
+	new(&context->recv_templ) Persistent<ObjectTemplate>();
+	Local<ObjectTemplate> templ = ObjectTemplate::New(isolate);
+	templ->SetInternalFieldCount(1);
+	context->recv_templ.Reset(isolate, templ);
+
+	/* Created on first use */
+	new(&context->plan_template) Persistent<ObjectTemplate>();
+	new(&context->cursor_template) Persistent<ObjectTemplate>();
+	new(&context->window_template) Persistent<ObjectTemplate>();
+}
+
+/*
+ * Runs the start up procedure if configured.
+ */
+static void
+RunStartProc(plv8_context *my_context)
+{
+	Isolate				   *isolate = my_context->isolate;
+
+	if (plv8_start_proc != NULL)
+	{
+		Local<Function>		func;
+
+		HandleScope			handle_scope(isolate);
+		Local<Context>		context = my_context->localContext();
+		Context::Scope		context_scope(context);
+		TryCatch			try_catch(isolate);
+		MemoryContext		ctx = CurrentMemoryContext;
+		text *arg;
+#if PG_VERSION_NUM < 120000
+		FunctionCallInfoData fake_fcinfo;
+#else
+		// Stack-allocate FunctionCallInfoBaseData with
+		// space for 2 arguments:
+		LOCAL_FCINFO(fake_fcinfo, 2);
+#endif
+		FmgrInfo	flinfo;
+
+		char perm[16];
+		strcpy(perm, "EXECUTE");
+		arg = charToText(perm);
+
+		PG_TRY();
+				{
+					Oid funcoid = DatumGetObjectId(DirectFunctionCall1(regprocin, CStringGetDatum(plv8_start_proc)));
+#if PG_VERSION_NUM < 120000
+					MemSet(&fake_fcinfo, 0, sizeof(fake_fcinfo));
+					MemSet(&flinfo, 0, sizeof(flinfo));
+					fake_fcinfo.flinfo = &flinfo;
+					flinfo.fn_oid = InvalidOid;
+					flinfo.fn_mcxt = CurrentMemoryContext;
+					fake_fcinfo.nargs = 2;
+					fake_fcinfo.arg[0] = ObjectIdGetDatum(funcoid);
+					fake_fcinfo.arg[1] = CStringGetDatum(arg);
+					Datum ret = has_function_privilege_id(&fake_fcinfo);
+#else
+					MemSet(&flinfo, 0, sizeof(flinfo));
+					fake_fcinfo->flinfo = &flinfo;
+					flinfo.fn_oid = InvalidOid;
+					flinfo.fn_mcxt = CurrentMemoryContext;
+					fake_fcinfo->nargs = 2;
+					fake_fcinfo->args[0].value = ObjectIdGetDatum(funcoid);
+					fake_fcinfo->args[1].value = PointerGetDatum(arg);
+					Datum ret = has_function_privilege_id(fake_fcinfo);
+#endif
+
+					if (ret == 0) {
+						elog(WARNING, "failed to find js function %s", plv8_start_proc);
+					} else {
+						if (DatumGetBool(ret)) {
+							func = find_js_function(funcoid);
+						} else {
+							elog(WARNING, "no permission to execute js function %s", plv8_start_proc);
+						}
+					}
+				}
+			PG_CATCH();
+				{
+					ErrorData	   *edata;
+
+					MemoryContextSwitchTo(ctx);
+					edata = CopyErrorData();
+					elog(WARNING, "failed to find js function %s", edata->message);
+					FlushErrorState();
+					FreeErrorData(edata);
+				}
+		PG_END_TRY();
+
+		pfree(arg);
+
+		if (!func.IsEmpty())
+		{
+			Handle<v8::Value>	result =
+					DoCall(context, func, my_context->localContext()->Global(), 0, NULL, false);
+			if (result.IsEmpty())
+				throw js_error(try_catch);
+		}
+	}
+}
+
+/*
+ * Creates the global context of a plv8 context, restored from the snapshot
+ * its isolate was booted from if any, and runs the start up procedure and
+ * plv8.prewarm in it.  The caller must have entered the isolate.
+ */
+static void
+InitGlobalContext(plv8_context *my_context)
+{
+	Isolate				   *isolate = my_context->isolate;
+	HandleScope				handle_scope(isolate);
+	Local<Context>			context;
+	bool					from_snapshot = my_context->snapshot.data != NULL;
+
+	/*
+	 * The snapshot already has the global object set up and the start
+	 * up procedure run.
+	 */
+	if (!from_snapshot ||
+		!Context::FromSnapshot(isolate, 0).ToLocal(&context))
+	{
+		Local<ObjectTemplate>	global = Local<ObjectTemplate>::New(isolate, GetGlobalObjectTemplate(isolate));
+
+		context = Context::New(isolate, NULL, global);
+		from_snapshot = false;
+	}
+	my_context->context.Reset(isolate, context);
+
+	if (!from_snapshot)
+		RunStartProc(my_context);
+
+	/*
+	 * Prewarming queries the catalogs and compiles in subtransactions,
+	 * neither of which is possible outside of a transaction or in a
+	 * parallel worker.  Those contexts compile on first call instead.
+	 */
+	if (plv8_prewarm_pattern != NULL && plv8_prewarm_pattern[0] != '\0' &&
+		IsTransactionState()
+#if PG_VERSION_NUM >= 90500
+		&& !IsInParallelMode()
+#endif
+		)
+	{
+		int		compiled = 0;
+		int		failed = 0;
+
+		PG_TRY();
+		{
+			plv8_prewarm_functions(plv8_prewarm_pattern, &compiled, &failed);
+		}
+		PG_CATCH();
+		{
+			throw pg_error();
+		}
+		PG_END_TRY();
+	}
+}
+
 static plv8_context*
 GetPlv8Context() {
 	Oid					user_id = GetUserId();
-	unsigned int		i;
-	plv8_context		*my_context = nullptr;
+	plv8_context		*my_context = last_context;
 
-	for (i = 0; i < ContextVector.size(); i++)
+	if (my_context == nullptr || my_context->user_id != user_id)
 	{
-		if (ContextVector[i]->user_id == user_id)
-		{
-			my_context = ContextVector[i];
-			break;
-		}
+		auto	found = ContextMap.find(user_id);
+
+		my_context = found != ContextMap.end() ? found->second : nullptr;
 	}
 	if (my_context && (my_context->is_dead || (my_context->isolate && my_context->isolate->IsDead()))) {
 		// the isolate is dead because of OOM, kill it and dispose
 		char *username = GetUserNameFromId(my_context->user_id, false);
 		elog(LOG_SERVER_ONLY, "Disposing of a dead isolate for: %s", username);
-		ContextVector.erase(ContextVector.begin() + i);
+		UnregisterContext(my_context);
 		if (my_context->isolate && my_context->isolate->IsInUse()) {
 			my_context->isolate->Exit();
 		}
@@ -1818,151 +3907,40 @@ GetPlv8Context() {
 	}
 	if (!my_context)
 	{
+		const StartupData	   *snapshot;
+
+		plv8_initialize_v8();
+		EvictPlv8Contexts(GetCurrentStatementStartTimestamp(), true);
+
 		my_context = (plv8_context *) MemoryContextAllocZero(TopMemoryContext,
 														 sizeof(plv8_context));
 		my_context->is_dead = false;
 		my_context->interrupted = false;
 		my_context->ignore_unhandled_promises = false;
-		CreateIsolate(my_context);
+		my_context->last_used = GetCurrentStatementStartTimestamp();
+
+		auto	evicted = evicted_users.find(user_id);
+		if (evicted != evicted_users.end())
+			my_context->recreations = ++evicted->second;
+		snapshot = plv8_snapshot_usable(user_id);
+		InstallSignalHandlers();
+		CreateIsolate(my_context, snapshot);
 		Isolate 			   *isolate = my_context->isolate;
 		Isolate::Scope			scope(isolate);
 		HandleScope				handle_scope(isolate);
 
-		Local<ObjectTemplate>	global = Local<ObjectTemplate>::New(isolate, GetGlobalObjectTemplate(isolate));
-
 		new(&my_context->context) Persistent<Context>();
-		my_context->context.Reset(isolate, Context::New(isolate, NULL, global));
 		my_context->user_id = user_id;
 
-		new(&my_context->recv_templ) Persistent<ObjectTemplate>();
-		Local<ObjectTemplate> templ = ObjectTemplate::New(isolate);
-		templ->SetInternalFieldCount(1);
-		my_context->recv_templ.Reset(isolate, templ);
-
-		new(&my_context->compile_context) Persistent<Context>();
-		Local<Context> ctx = Context::New(isolate, (ExtensionConfiguration*)NULL);
-		my_context->compile_context.Reset(isolate, ctx);
-
-		auto toStringAttr = static_cast<PropertyAttribute>(v8::ReadOnly | v8::DontEnum);
-		auto toStringSymbol = v8::Symbol::GetToStringTag(isolate);
-
-		new(&my_context->plan_template) Persistent<ObjectTemplate>();
-		Local<FunctionTemplate> base = FunctionTemplate::New(isolate);
-		Local<v8::String> planClassName = v8::String::NewFromUtf8Literal(isolate, "PreparedPlan",
-														   NewStringType::kInternalized);
-		base->SetClassName(planClassName);
-		base->PrototypeTemplate()->Set(toStringSymbol, planClassName, toStringAttr);
-		templ = base->InstanceTemplate();
-		SetupPrepFunctions(templ);
-		my_context->plan_template.Reset(isolate, templ);
-
-		new(&my_context->cursor_template) Persistent<ObjectTemplate>();
-		base = FunctionTemplate::New(isolate);
-		Local<v8::String> cursorClassName = v8::String::NewFromUtf8Literal(isolate, "Cursor",
-															 NewStringType::kInternalized);
-		base->SetClassName(cursorClassName);
-		base->PrototypeTemplate()->Set(toStringSymbol, cursorClassName, toStringAttr);
-		templ = base->InstanceTemplate();
-		SetupCursorFunctions(templ);
-		my_context->cursor_template.Reset(isolate, templ);
-
-		new(&my_context->window_template) Persistent<ObjectTemplate>();
-		base = FunctionTemplate::New(isolate);
-		Local<v8::String> windowClassName = v8::String::NewFromUtf8Literal(isolate, "WindowObject",
-															 NewStringType::kInternalized);
-        base->SetClassName(windowClassName);
-		base->PrototypeTemplate()->Set(toStringSymbol, windowClassName, toStringAttr);
-		templ = base->InstanceTemplate();
-		SetupWindowFunctions(templ);
-		my_context->window_template.Reset(isolate, templ);
+		InitContextTemplates(my_context);
+
 		/*
 		 * Need to register it before running any code, as the code
 		 * recursively may want to the global context.
 		 */
-		ContextVector.push_back(my_context);
-
-		/*
-		 * Run the start up procedure if configured.
-		 */
-		if (plv8_start_proc != NULL)
-		{
-			Local<Function>		func;
-
-			HandleScope			handle_scope(isolate);
-			Local<Context>		context = my_context->localContext();
-			Context::Scope		context_scope(context);
-			TryCatch			try_catch(isolate);
-			MemoryContext		ctx = CurrentMemoryContext;
-			text *arg;
-#if PG_VERSION_NUM < 120000
-			FunctionCallInfoData fake_fcinfo;
-#else
-			// Stack-allocate FunctionCallInfoBaseData with
-			// space for 2 arguments:
-			LOCAL_FCINFO(fake_fcinfo, 2);
-#endif
-			FmgrInfo	flinfo;
-
-			char perm[16];
-			strcpy(perm, "EXECUTE");
-			arg = charToText(perm);
-
-			PG_TRY();
-					{
-						Oid funcoid = DatumGetObjectId(DirectFunctionCall1(regprocin, CStringGetDatum(plv8_start_proc)));
-#if PG_VERSION_NUM < 120000
-						MemSet(&fake_fcinfo, 0, sizeof(fake_fcinfo));
-						MemSet(&flinfo, 0, sizeof(flinfo));
-						fake_fcinfo.flinfo = &flinfo;
-						flinfo.fn_oid = InvalidOid;
-						flinfo.fn_mcxt = CurrentMemoryContext;
-						fake_fcinfo.nargs = 2;
-						fake_fcinfo.arg[0] = ObjectIdGetDatum(funcoid);
-						fake_fcinfo.arg[1] = CStringGetDatum(arg);
-						Datum ret = has_function_privilege_id(&fake_fcinfo);
-#else
-						MemSet(&flinfo, 0, sizeof(flinfo));
-						fake_fcinfo->flinfo = &flinfo;
-						flinfo.fn_oid = InvalidOid;
-						flinfo.fn_mcxt = CurrentMemoryContext;
-						fake_fcinfo->nargs = 2;
-						fake_fcinfo->args[0].value = ObjectIdGetDatum(funcoid);
-						fake_fcinfo->args[1].value = PointerGetDatum(arg);
-						Datum ret = has_function_privilege_id(fake_fcinfo);
-#endif
-
-						if (ret == 0) {
-							elog(WARNING, "failed to find js function %s", plv8_start_proc);
-						} else {
-							if (DatumGetBool(ret)) {
-								func = find_js_function(funcoid);
-							} else {
-								elog(WARNING, "no permission to execute js function %s", plv8_start_proc);
-							}
-						}
-					}
-				PG_CATCH();
-					{
-						ErrorData	   *edata;
-
-						MemoryContextSwitchTo(ctx);
-						edata = CopyErrorData();
-						elog(WARNING, "failed to find js function %s", edata->message);
-						FlushErrorState();
-						FreeErrorData(edata);
-					}
-			PG_END_TRY();
-
-			pfree(arg);
+		RegisterContext(my_context);
 
-			if (!func.IsEmpty())
-			{
-				Handle<v8::Value>	result =
-						DoCall(context, func, my_context->localContext()->Global(), 0, NULL, false);
-				if (result.IsEmpty())
-					throw js_error(try_catch);
-			}
-		}
+		InitGlobalContext(my_context);
 
 #ifdef ENABLE_DEBUGGER_SUPPORT
 		debug_message_context = v8::Persistent<v8::Context>::New(global_context);
@@ -1974,9 +3952,104 @@ GetPlv8Context() {
 		v8::Debug::EnableAgent("plv8", plv8_debugger_port, false);
 #endif  // ENABLE_DEBUGGER_SUPPORT
 	}
+	else
+	{
+		my_context->last_used = GetCurrentStatementStartTimestamp();
+		my_context->trimmed = false;
+	}
+	last_context = my_context;
 	return my_context;
 }
 
+/*
+ * Drops every handle the temporary context used for building a snapshot
+ * holds into its isolate, and unregisters it, putting back the context of
+ * the user it stood in for if any.
+ */
+static void
+ReleaseSnapshotContext(plv8_context *context, plv8_context *previous)
+{
+	plv8_exec_env	   *env;
+
+	ForgetUserFunctions(context->user_id);
+	for (env = exec_env_head; env != NULL; env = env->next)
+	{
+		if (env->isolate == context->isolate)
+			plv8_clear_exec_env(env);
+	}
+
+	context->context.Reset();
+	context->recv_templ.Reset();
+	context->plan_template.Reset();
+	context->cursor_template.Reset();
+	context->window_template.Reset();
+	context->unhandled_promises.clear();
+
+	UnregisterContext(context);
+	if (previous != nullptr)
+		ContextMap[previous->user_id] = previous;
+	if (current_context == context)
+		current_context = nullptr;
+	WatchdogSync();
+}
+
+/*
+ * Creates a startup snapshot of a fresh context, with the start up
+ * procedure run in it.  The snapshot's isolate stands in for the current
+ * user's context meanwhile, so that the start up procedure can call other
+ * functions.  The returned blob is owned by the caller.
+ */
+static StartupData
+BuildSnapshot()
+{
+	SnapshotCreator		creator(plv8_external_references);
+	Isolate			   *isolate = creator.GetIsolate();
+	plv8_context	   *context;
+	plv8_context	   *previous = nullptr;
+	StartupData			blob;
+	auto				found = ContextMap.find(GetUserId());
+
+	if (found != ContextMap.end())
+		previous = found->second;
+	context = (plv8_context *) MemoryContextAllocZero(TopMemoryContext,
+													  sizeof(plv8_context));
+	context->isolate = isolate;
+	context->user_id = GetUserId();
+	context->building_snapshot = true;
+	new(&context->context) Persistent<Context>();
+	isolate->SetPromiseRejectCallback(PromiseRejectCB);
+
+	try
+	{
+		HandleScope				handle_scope(isolate);
+		Local<ObjectTemplate>	global = Local<ObjectTemplate>::New(isolate, GetGlobalObjectTemplate(isolate));
+		Local<Context>			ctx = Context::New(isolate, NULL, global);
+
+		context->context.Reset(isolate, ctx);
+		InitContextTemplates(context);
+		RegisterContext(context);
+		current_context = last_context = context;
+
+		RunStartProc(context);
+
+		ReleaseSnapshotContext(context, previous);
+		creator.SetDefaultContext(Context::New(isolate));
+		creator.AddContext(ctx);
+	}
+	catch (...)
+	{
+		ReleaseSnapshotContext(context, previous);
+		pfree(context);
+		throw;
+	}
+	pfree(context);
+
+	blob = creator.CreateBlob(SnapshotCreator::FunctionCodeHandling::kClear);
+	if (blob.data == NULL)
+		throw js_error("could not create a snapshot");
+	return blob;
+}
+
 static Local<ObjectTemplate>
 GetGlobalObjectTemplate(Isolate *isolate)
 {
@@ -2031,7 +4104,7 @@ GetGlobalObjectTemplate(Isolate *isolate)
 plv8_type *
 get_plv8_type(PG_FUNCTION_ARGS, int argno)
 {
-	plv8_proc *proc = (plv8_proc *) fcinfo->flinfo->fn_extra;
+	plv8_proc *proc = ((plv8_call_site *) fcinfo->flinfo->fn_extra)->proc;
 	return &proc->argtypes[argno];
 }
 
@@ -2336,15 +4409,11 @@ js_error::init(Isolate *isolate, v8::Local<v8::Value> exception, v8::Local<Messa
 			// TODO: Get stack trace?
 			//Handle<StackTrace> stackTrace(message->GetStackTrace());
 
-			/*
-			 * Report lineno - 1 because "function _(...){" was added
-			 * at the first line to the javascript code.
-			 */
 			if (strstr(m_msg, "Error: ") == m_msg)
 				m_msg += 7;
 
 			appendStringInfo(&contextStr, "%s() LINE %d: %s",
-				script.str("?"), lineno - 1, source.str("?"));
+				script.str("?"), lineno, source.str("?"));
 		}
 
 		m_context = contextStr.data;
@@ -20,6 +20,7 @@ extern "C" {
 #include "postgres.h"
 
 #include "access/htup.h"
+#include "datatype/timestamp.h"
 #include "fmgr.h"
 #include "mb/pg_wchar.h"
 #include "utils/tuplestore.h"
@@ -106,6 +107,8 @@ typedef struct plv8_type
 	FmgrInfo	fn_input;
 	FmgrInfo	fn_output;
 	plv8_external_array_type ext_array;
+	bool		ext_array_domain;	/* ext_array is set by a plv8_*array domain */
+	struct plv8_type *elem;		/* element type, for arrays */
 } plv8_type;
 
 /*
@@ -118,7 +121,6 @@ typedef struct plv8_context
 	v8::ArrayBuffer::Allocator	   	   *array_buffer_allocator;
 	v8::Persistent<v8::Context>			context;
 	v8::Persistent<v8::ObjectTemplate>	recv_templ;
-	v8::Persistent<v8::Context>			compile_context;
 	v8::Persistent<v8::ObjectTemplate>  plan_template;
 	v8::Persistent<v8::ObjectTemplate>  cursor_template;
 	v8::Persistent<v8::ObjectTemplate>  window_template;
@@ -128,6 +130,14 @@ typedef struct plv8_context
 	Oid							user_id;
 	std::vector<std::tuple<v8::Global<v8::Promise>, v8::Global<v8::Message>, v8::Global<v8::Value>>> unhandled_promises;
 	bool 						ignore_unhandled_promises;
+	uint64						code_cache_hits;
+	uint64						code_cache_misses;
+	uint64						code_cache_rejects;
+	bool						building_snapshot;
+	v8::StartupData				snapshot;	/* the isolate was booted from */
+	TimestampTz					last_used;
+	uint64						recreations;
+	bool						trimmed;	/* since it was last used */
 } plv8_context;
 
 /*
@@ -277,10 +287,24 @@ public:
 	}
 };
 
+/*
+ * How NUMERIC values are converted to JavaScript.
+ */
+typedef enum plv8_numeric_mode
+{
+	PLV8_NUMERIC_FLOAT,			/* number, may lose precision */
+	PLV8_NUMERIC_EXACT,			/* number if it round-trips, else string */
+	PLV8_NUMERIC_BIGINT,		/* BigInt if no fractional digits, else string */
+	PLV8_NUMERIC_STRING			/* decimal string */
+} plv8_numeric_mode;
+
 extern plv8_context* current_context;
+extern int plv8_numeric_conversion;
+extern bool plv8_typed_arrays;
 extern v8::Local<v8::Function> find_js_function(Oid fn_oid);
 extern v8::Local<v8::Function> find_js_function_by_name(const char *signature);
 extern const char *FormatSPIStatus(int status) throw();
+extern void EnsureSPIConnected();
 extern plv8_type *get_plv8_type(PG_FUNCTION_ARGS, int argno);
 
 // plv8_type.cc
@@ -288,6 +312,7 @@ extern void plv8_fill_type(plv8_type *type, Oid typid, MemoryContext mcxt = NULL
 extern Oid inferred_datum_type(v8::Handle<v8::Value> value);
 extern Datum ToDatum(v8::Handle<v8::Value> value, bool *isnull, plv8_type *type);
 extern v8::Local<v8::Value> ToValue(Datum datum, bool isnull, plv8_type *type);
+extern void plv8_free_external_datums();
 extern v8::Local<v8::String> ToString(Datum value, plv8_type *type);
 extern v8::Local<v8::String> ToString(const char *str, int len = -1, int encoding = GetDatabaseEncoding());
 extern char *ToCString(const v8::String::Utf8Value &value);
@@ -301,6 +326,7 @@ extern void SetupPlv8Functions(v8::Handle<v8::ObjectTemplate> plv8);
 extern void SetupPrepFunctions(v8::Handle<v8::ObjectTemplate> templ);
 extern void SetupCursorFunctions(v8::Handle<v8::ObjectTemplate> templ);
 extern void SetupWindowFunctions(v8::Handle<v8::ObjectTemplate> templ);
+extern const intptr_t plv8_external_references[];
 
 extern void HandleUnhandledPromiseRejections();
 
@@ -309,5 +335,7 @@ extern void GetMemoryInfo(v8::Local<v8::Object> obj);
 extern struct config_generic *plv8_find_option(const char *name);
 char *plv8_string_option(struct config_generic * record);
 int plv8_int_option(struct config_generic * record);
+bool plv8_bool_option(struct config_generic * record);
+int plv8_enum_option(struct config_generic * record);
 
 #endif	// _PLV8_
@@ -284,6 +284,29 @@ SetupPlv8Functions(Handle<ObjectTemplate> plv8)
 	plv8->SetInternalFieldCount(PLV8_INTNL_MAX);
 }
 
+/*
+ * Returns the instance template of a class of objects returned by plv8
+ * functions, creating it on first use, as most contexts never need it.
+ */
+static Local<ObjectTemplate>
+GetClassTemplate(Isolate *isolate, Persistent<ObjectTemplate> &cache,
+				 const char *class_name, void (*setup)(Handle<ObjectTemplate>))
+{
+	if (!cache.IsEmpty())
+		return Local<ObjectTemplate>::New(isolate, cache);
+
+	auto toStringAttr = static_cast<PropertyAttribute>(v8::ReadOnly | v8::DontEnum);
+	Local<FunctionTemplate> base = FunctionTemplate::New(isolate);
+	Local<v8::String> className = v8::String::NewFromUtf8(isolate, class_name,
+										NewStringType::kInternalized).ToLocalChecked();
+	base->SetClassName(className);
+	base->PrototypeTemplate()->Set(v8::Symbol::GetToStringTag(isolate), className, toStringAttr);
+	Local<ObjectTemplate> templ = base->InstanceTemplate();
+	setup(templ);
+	cache.Reset(isolate, templ);
+	return templ;
+}
+
 void
 SetupPrepFunctions(Handle<ObjectTemplate> templ)
 {
@@ -327,6 +350,46 @@ SetupWindowFunctions(Handle<ObjectTemplate> templ)
 	templ->Set(v8::String::NewFromUtf8(isolate, "SEEK_TAIL").ToLocalChecked(), Int32::New(isolate, WINDOW_SEEK_TAIL));
 }
 
+/*
+ * Every native address reachable from the global template, so that V8 can
+ * serialize it into a startup snapshot and patch it back on deserialization.
+ * The callbacks are stored as External data by WrapCallback().
+ */
+const intptr_t plv8_external_references[] = {
+	reinterpret_cast<intptr_t>(plv8_FunctionInvoker),
+	reinterpret_cast<intptr_t>(plv8_Elog),
+	reinterpret_cast<intptr_t>(plv8_Execute),
+	reinterpret_cast<intptr_t>(plv8_Prepare),
+	reinterpret_cast<intptr_t>(plv8_PlanCursor),
+	reinterpret_cast<intptr_t>(plv8_PlanExecute),
+	reinterpret_cast<intptr_t>(plv8_PlanFree),
+	reinterpret_cast<intptr_t>(plv8_CursorFetch),
+	reinterpret_cast<intptr_t>(plv8_CursorMove),
+	reinterpret_cast<intptr_t>(plv8_CursorClose),
+	reinterpret_cast<intptr_t>(plv8_ReturnNext),
+	reinterpret_cast<intptr_t>(plv8_Subtransaction),
+	reinterpret_cast<intptr_t>(plv8_FindFunction),
+	reinterpret_cast<intptr_t>(plv8_GetWindowObject),
+	reinterpret_cast<intptr_t>(plv8_WinGetPartitionLocal),
+	reinterpret_cast<intptr_t>(plv8_WinSetPartitionLocal),
+	reinterpret_cast<intptr_t>(plv8_WinGetCurrentPosition),
+	reinterpret_cast<intptr_t>(plv8_WinGetPartitionRowCount),
+	reinterpret_cast<intptr_t>(plv8_WinSetMarkPosition),
+	reinterpret_cast<intptr_t>(plv8_WinRowsArePeers),
+	reinterpret_cast<intptr_t>(plv8_WinGetFuncArgInPartition),
+	reinterpret_cast<intptr_t>(plv8_WinGetFuncArgInFrame),
+	reinterpret_cast<intptr_t>(plv8_WinGetFuncArgCurrent),
+	reinterpret_cast<intptr_t>(plv8_QuoteLiteral),
+	reinterpret_cast<intptr_t>(plv8_QuoteNullable),
+	reinterpret_cast<intptr_t>(plv8_QuoteIdent),
+	reinterpret_cast<intptr_t>(plv8_MemoryUsage),
+#if PG_VERSION_NUM >= 110000
+	reinterpret_cast<intptr_t>(plv8_Commit),
+	reinterpret_cast<intptr_t>(plv8_Rollback),
+#endif
+	0
+};
+
 /*
  * v8 is not exception-safe! We cannot throw C++ exceptions over v8 functions.
  * So, we catch C++ exceptions and convert them to JavaScript ones.
@@ -605,6 +668,7 @@ plv8_Execute(const FunctionCallbackInfo<v8::Value> &args)
 
 	int				nparam = params.IsEmpty() ? 0 : params->Length();
 
+	EnsureSPIConnected();
 
 	SubTranBlock	subtran;
 	PG_TRY();
@@ -642,6 +706,10 @@ plv8_Prepare(const FunctionCallbackInfo<v8::Value> &args)
 	Oid			   *types = NULL;
 	plv8_param_state *parstate = NULL;
 
+	/* A plan can't be carried over into a snapshot. */
+	if (current_context->building_snapshot)
+		throw js_error("plv8.prepare() cannot be used while building a snapshot");
+
 	if (args.Length() > 1)
 	{
 		if (args[1]->IsArray())
@@ -668,6 +736,8 @@ plv8_Prepare(const FunctionCallbackInfo<v8::Value> &args)
 #endif
 	}
 
+	EnsureSPIConnected();
+
 	PG_TRY();
 	{
 #if PG_VERSION_NUM >= 90000
@@ -691,7 +761,8 @@ plv8_Prepare(const FunctionCallbackInfo<v8::Value> &args)
 	}
 	PG_END_TRY();
 
-	Local<ObjectTemplate> templ = Local<ObjectTemplate>::New(isolate, current_context->plan_template);
+	Local<ObjectTemplate> templ = GetClassTemplate(isolate, current_context->plan_template,
+										"PreparedPlan", SetupPrepFunctions);
 
 	Local<v8::Object> result = templ->NewInstance(isolate->GetCurrentContext()).ToLocalChecked();
 	result->SetInternalField(0, External::New(isolate, saved));
@@ -779,6 +850,8 @@ plv8_PlanCursor(const FunctionCallbackInfo<v8::Value> &args)
 		values[i] = value_get_datum(param, typid, &nulls[i]);
 	}
 
+	EnsureSPIConnected();
+
 	PG_TRY();
 	{
 #if PG_VERSION_NUM >= 90000
@@ -800,7 +873,8 @@ plv8_PlanCursor(const FunctionCallbackInfo<v8::Value> &args)
 	PG_END_TRY();
 
 	Handle<v8::String> cname = ToString(cursor->name, strlen(cursor->name));
-	Local<ObjectTemplate> templ = Local<ObjectTemplate>::New(isolate, current_context->cursor_template);
+	Local<ObjectTemplate> templ = GetClassTemplate(isolate, current_context->cursor_template,
+										"Cursor", SetupCursorFunctions);
 
 	Local<v8::Object> result = templ->NewInstance(isolate->GetCurrentContext()).ToLocalChecked();
 	result->SetInternalField(0, cname);
@@ -880,6 +954,8 @@ plv8_PlanExecute(const FunctionCallbackInfo<v8::Value> &args)
 		values[i] = value_get_datum(param, typid, &nulls[i]);
 	}
 
+	EnsureSPIConnected();
+
 	PG_TRY();
 	{
 		subtran.enter();
@@ -971,6 +1047,9 @@ plv8_CursorFetch(const FunctionCallbackInfo<v8::Value> &args)
 			forward = false;
 		}
 	}
+
+	EnsureSPIConnected();
+
 	PG_TRY();
 	{
 		SPI_cursor_fetch(cursor, forward, nfetch);
@@ -1038,6 +1117,8 @@ plv8_CursorMove(const FunctionCallbackInfo<v8::Value>& args)
 		forward = false;
 	}
 
+	EnsureSPIConnected();
+
 	PG_TRY();
 	{
 		SPI_cursor_move(cursor, forward, nmove);
@@ -1124,6 +1205,11 @@ plv8_Subtransaction(const FunctionCallbackInfo<v8::Value>& args)
 	Handle<Function>	func = Handle<Function>::Cast(args[0]);
 	SubTranBlock		subtran;
 
+	/*
+	 * The function body is likely to use SPI; connect now, as a connection
+	 * made inside the subtransaction would not survive its end.
+	 */
+	EnsureSPIConnected();
 	subtran.enter();
 
 	Handle<v8::Value> emptyargs[1] = {};
@@ -1230,7 +1316,8 @@ plv8_GetWindowObject(const FunctionCallbackInfo<v8::Value>& args)
 
 	if (!fcinfo_value->IsExternal())
 		throw js_error("get_window_object called in wrong context");
-	Local<ObjectTemplate> templ = Local<ObjectTemplate>::New(isolate, current_context->window_template);
+	Local<ObjectTemplate> templ = GetClassTemplate(isolate, current_context->window_template,
+										"WindowObject", SetupWindowFunctions);
 
 	Local<v8::Object> js_winobj = templ->NewInstance(isolate->GetCurrentContext()).ToLocalChecked();
 	js_winobj->SetInternalField(0, fcinfo_value);
@@ -1718,6 +1805,8 @@ void GetMemoryInfo(v8::Local<v8::Object> obj) {
 static void
 plv8_Commit(const FunctionCallbackInfo<v8::Value> &args)
 {
+	EnsureSPIConnected();
+
 	PG_TRY();
 	{
 		HoldPinnedPortals();
@@ -1734,6 +1823,8 @@ plv8_Commit(const FunctionCallbackInfo<v8::Value> &args)
 static void
 plv8_Rollback(const FunctionCallbackInfo<v8::Value> &args)
 {
+	EnsureSPIConnected();
+
 	PG_TRY();
 	{
 		HoldPinnedPortals();
@@ -7,6 +7,12 @@
  */
 #include "plv8.h"
 
+#include <cfloat>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <vector>
+
 extern "C" {
 #if JSONB_DIRECT_CONVERSION
 #include <time.h>
@@ -14,6 +20,11 @@ extern "C" {
 #if PG_VERSION_NUM >= 90300
 #include "access/htup_details.h"
 #endif
+#if PG_VERSION_NUM >= 130000
+#include "access/detoast.h"
+#else
+#include "access/tuptoaster.h"
+#endif
 #include "catalog/pg_type.h"
 #include "parser/parse_coerce.h"
 #include "utils/array.h"
@@ -107,7 +118,10 @@ plv8_fill_type(plv8_type *type, Oid typid, MemoryContext mcxt)
 			elog(ERROR, "cache lookup failed for type %d", typid);
 
 		if (type->ext_array)
-			return;
+		{
+			type->ext_array_domain = true;
+			typid = getBaseType(typid);
+		}
 
 		/* If not, do as usual. */
 	}
@@ -123,6 +137,33 @@ plv8_fill_type(plv8_type *type, Oid typid, MemoryContext mcxt)
 		type->typid = elemid;
 		type->is_composite = (TypeCategory(elemid) == TYPCATEGORY_COMPOSITE);
 		get_typlenbyvalalign(type->typid, &type->len, &type->byval, &type->align);
+
+		/* ToArrayValue converts the elements with this, keeping fn_output */
+		type->elem = (plv8_type *) MemoryContextAllocZero(mcxt, sizeof(plv8_type));
+		plv8_fill_type(type->elem, elemid, mcxt);
+
+		/* Used when plv8.typed_arrays is on. */
+		switch (elemid)
+		{
+		case BOOLOID:
+			type->ext_array = kExternalUnsignedByteArray;
+			break;
+		case INT2OID:
+			type->ext_array = kExternalShortArray;
+			break;
+		case INT4OID:
+			type->ext_array = kExternalIntArray;
+			break;
+		case INT8OID:
+			type->ext_array = kExternalInt64Array;
+			break;
+		case FLOAT4OID:
+			type->ext_array = kExternalFloatArray;
+			break;
+		case FLOAT8OID:
+			type->ext_array = kExternalDoubleArray;
+			break;
+		}
 	}
 }
 
@@ -552,15 +593,162 @@ ConvertObject(Local<v8::Object> object) {
 }
 #endif
 
+/*
+ * Text values of at least this many bytes become external strings when
+ * they are ASCII.  Copying smaller ones to the V8 heap is cheap enough.
+ */
+#define PLV8_EXTERNAL_STRING_SIZE	(64 * 1024)
+
+/*
+ * Datums viewed by typed arrays and external strings live here rather
+ * than in the caller's context, as the script may keep them after the call
+ * returns.
+ */
+static MemoryContext external_datum_context = NULL;
+
+/*
+ * V8 may release a backing store or an external string on one of its own
+ * threads, so they only queue the datum.  plv8_free_external_datums frees
+ * the queue on the main thread, at each call boundary and transaction end.
+ */
+static std::mutex external_datum_lock;
+static std::vector<void *> dead_external_datums;
+
+static void
+QueueDeadExternalDatum(void *datum)
+{
+	std::lock_guard<std::mutex> lock(external_datum_lock);
+
+	dead_external_datums.push_back(datum);
+}
+
+static void
+ExternalArrayDeleter(void *data, size_t length, void *deleter_data)
+{
+	QueueDeadExternalDatum(deleter_data);
+}
+
+/*
+ * An ASCII text datum from DetoastExternalDatum, which V8 reads in place
+ * as a one-byte string.
+ */
+class ExternalTextResource : public v8::String::ExternalOneByteStringResource
+{
+public:
+	explicit ExternalTextResource(void *datum) : m_datum(datum) {}
+	const char *data() const override { return VARDATA_ANY(m_datum); }
+	size_t length() const override { return VARSIZE_ANY_EXHDR(m_datum); }
+	void Dispose() override
+	{
+		QueueDeadExternalDatum(m_datum);
+		delete this;
+	}
+
+private:
+	void	   *m_datum;
+};
+
+void
+plv8_free_external_datums()
+{
+	std::vector<void *> dead;
+
+	/* Nothing was ever handed to V8 */
+	if (external_datum_context == NULL)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(external_datum_lock);
+
+		dead.swap(dead_external_datums);
+	}
+
+	for (void *p : dead)
+		pfree(p);
+}
+
+/*
+ * Whether the bytes are all ASCII, checked a word at a time.
+ */
+static bool
+IsAscii(const char *str, size_t len)
+{
+	const uint64	high_bits = UINT64CONST(0x8080808080808080);
+	const char	   *end = str + len;
+	uint64			word[4];
+
+	while (end - str >= (ptrdiff_t) sizeof(word))
+	{
+		memcpy(word, str, sizeof(word));
+		if ((word[0] | word[1] | word[2] | word[3]) & high_bits)
+			return false;
+		str += sizeof(word);
+	}
+	for (; str < end; str++)
+	{
+		if (*str & 0x80)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Detoast a copy of the datum into external_datum_context, ready to be
+ * handed to CreateExternalArray or ExternalTextResource.
+ */
+static void *
+DetoastExternalDatum(Datum datum)
+{
+	MemoryContext	oldcontext;
+	void		   *p;
+
+	if (external_datum_context == NULL)
+		external_datum_context = AllocSetContextCreate(TopMemoryContext,
+								"PLv8 external data",
+#if PG_VERSION_NUM < 110000
+								ALLOCSET_DEFAULT_MINSIZE,
+								ALLOCSET_DEFAULT_INITSIZE,
+								ALLOCSET_DEFAULT_MAXSIZE
+#else
+								ALLOCSET_DEFAULT_SIZES
+#endif
+								);
+
+	oldcontext = MemoryContextSwitchTo(external_datum_context);
+	p = PG_DETOAST_DATUM_COPY(datum);
+	MemoryContextSwitchTo(oldcontext);
+
+	return p;
+}
+
+/*
+ * Wrap the payload of a datum from DetoastExternalDatum in a typed
+ * array without copying it.  elemtype is the element type of an array
+ * datum, InvalidOid for others.  The datum is the script's private copy, so
+ * writes go straight into it and are seen when the array is returned.
+ */
 static Local<Object>
 CreateExternalArray(void *data, plv8_external_array_type array_type,
-					int byte_size, Datum datum)
+					int byte_size, Datum datum, Oid elemtype)
 {
 	Isolate* isolate = Isolate::GetCurrent();
 	Local<v8::ArrayBuffer> buffer;
 	Local<v8::TypedArray> array;
 
-	buffer = v8::ArrayBuffer::New(isolate, byte_size);
+	/* The datum pointer kept in the array can't go into a snapshot. */
+	if (current_context && current_context->building_snapshot)
+	{
+		pfree(DatumGetPointer(datum));
+		throw js_error("typed arrays cannot be created while building a snapshot");
+	}
+
+	/* From here on the backing store owns the datum. */
+	std::shared_ptr<v8::BackingStore> store =
+		v8::ArrayBuffer::NewBackingStore(data, byte_size,
+										 ExternalArrayDeleter,
+										 DatumGetPointer(datum));
+	buffer = v8::ArrayBuffer::New(isolate, std::move(store));
 	if (buffer.IsEmpty())
 	{
 		return {};
@@ -594,17 +782,20 @@ CreateExternalArray(void *data, plv8_external_array_type array_type,
 		break;
 	case kExternalInt64Array:
 		array = v8::BigInt64Array::New(buffer, 0, byte_size / sizeof(int64));
+		break;
 	default:
 		throw js_error("unexpected array type");
 	}
 	array->SetInternalField(0, External::New(isolate, DatumGetPointer(datum)));
-
-	// needs to be a copy, as the data could go away
-	memcpy(buffer->GetBackingStore()->Data(), data, byte_size);
+	array->SetInternalField(1, Integer::NewFromUnsigned(isolate, elemtype));
 
 	return array;
 }
 
+/*
+ * Returns a copy of the datum behind a typed array in the current memory
+ * context, so the result does not depend on the array staying alive.
+ */
 static void *
 ExtractExternalArrayDatum(Handle<v8::Value> value)
 {
@@ -615,7 +806,17 @@ ExtractExternalArrayDatum(Handle<v8::Value> value)
 	if (value->IsTypedArray())
 	{
 		Handle<Object> object = Handle<Object>::Cast(value);
-		return Handle<External>::Cast(object->GetInternalField(0))->Value();
+		Local<v8::Value> field = object->GetInternalField(0);
+
+		/* Not made by CreateExternalArray */
+		if (!field->IsExternal())
+			return NULL;
+
+		void   *p = Handle<External>::Cast(field)->Value();
+		void   *result = palloc(VARSIZE(p));
+
+		memcpy(result, p, VARSIZE(p));
+		return result;
 	}
 
 	return NULL;
@@ -690,12 +891,22 @@ ToScalarDatum(Handle<v8::Value> value, bool *isnull, plv8_type *type)
 		break;
 	case NUMERICOID:
 		if (value->IsBigInt()) {
+			bool	lossless;
+			int64	iv = BigInt::Cast(*value)->Int64Value(&lossless);
+
+			if (lossless)
+				return DirectFunctionCall1(int8_numeric, Int64GetDatum(iv));
 			v8::String::Utf8Value utf8(isolate, value->ToString(isolate->GetCurrentContext()).ToLocalChecked());
 			return DirectFunctionCall3(numeric_in, (Datum) *utf8, ObjectIdGetDatum(InvalidOid), Int32GetDatum((int32) -1));
 		}
-		if (value->IsNumber())
-			return DirectFunctionCall1(float8_numeric,
-					Float8GetDatum((float8) value->NumberValue(isolate->GetCurrentContext()).ToChecked()));
+		if (value->IsNumber()) {
+			double	fv = value->NumberValue(isolate->GetCurrentContext()).ToChecked();
+
+			/* Integers are exact, and skip float8_numeric's formatting */
+			if (fv == floor(fv) && fabs(fv) <= 9007199254740992.0)
+				return DirectFunctionCall1(int8_numeric, Int64GetDatum((int64) fv));
+			return DirectFunctionCall1(float8_numeric, Float8GetDatum((float8) fv));
+		}
 		break;
 	case DATEOID:
 		if (value->IsDate())
@@ -839,14 +1050,210 @@ ToScalarDatum(Handle<v8::Value> value, bool *isnull, plv8_type *type)
 	return result;
 }
 
+/*
+ * A bool element must be 0 or 1, whatever the script stored in it.  The
+ * array has no NULLs, as it came from a typed array.
+ */
+static void
+NormalizeBoolArray(ArrayType *array)
+{
+	char	   *p = ARR_DATA_PTR(array);
+	int			nelems = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+
+	for (int i = 0; i < nelems; i++)
+		p[i] = (p[i] != 0);
+}
+
+/*
+ * Whether a typed array holds the elements of an array of the given
+ * external array type, so that its contents can be copied as they are.
+ */
+static bool
+IsExternalArrayOf(Handle<v8::Value> value, plv8_external_array_type array_type)
+{
+	switch (array_type)
+	{
+	case kExternalUnsignedByteArray:
+		return value->IsUint8Array();
+	case kExternalShortArray:
+		return value->IsInt16Array();
+	case kExternalIntArray:
+		return value->IsInt32Array();
+	case kExternalFloatArray:
+		return value->IsFloat32Array();
+	case kExternalDoubleArray:
+		return value->IsFloat64Array();
+	case kExternalInt64Array:
+		return value->IsBigInt64Array();
+	default:
+		return false;
+	}
+}
+
+/*
+ * Read the dimensions of a typed array from its shape property, as set
+ * by ToArrayValue.  Without one, the array has one dimension.
+ */
+static int
+GetArrayShape(Handle<ArrayBufferView> view, size_t nelems, int *dims)
+{
+	Isolate	   *isolate = Isolate::GetCurrent();
+	Local<Context>	context = isolate->GetCurrentContext();
+	Local<v8::Value> shape = view->Get(context,
+			v8::String::NewFromUtf8Literal(isolate, "shape")).ToLocalChecked();
+	int			ndim;
+	size_t		product = 1;
+
+	if (shape->IsUndefined())
+	{
+		dims[0] = nelems;
+		return 1;
+	}
+
+	if (!shape->IsArray() ||
+		(ndim = Local<Array>::Cast(shape)->Length()) == 0 || ndim > MAXDIM)
+		throw js_error("shape must be an array of 1 to 6 dimensions");
+	for (int i = 0; i < ndim; i++)
+	{
+		Local<v8::Value> dim = Local<Array>::Cast(shape)->Get(context, i).ToLocalChecked();
+
+		if (!dim->IsUint32() || dim.As<Uint32>()->Value() > MaxArraySize)
+			throw js_error("shape must be an array of dimension lengths");
+		dims[i] = dim.As<Uint32>()->Value();
+		product *= dims[i];
+		if (product > nelems)
+			break;
+	}
+	if (product != nelems)
+		throw js_error("shape does not match the length of the typed array");
+
+	return ndim;
+}
+
+/*
+ * Convert a typed array or DataView to an array with a single copy of its
+ * contents, shaped by the shape property of a typed array.  Both are in
+ * the platform's byte order, which is also the one of array datums.
+ * Returns false if the view's elements are not those of the array type,
+ * in which case the caller converts them one by one.
+ */
+static bool
+ArrayBufferViewToDatum(Handle<ArrayBufferView> view, plv8_type *type,
+					   Datum *datum)
+{
+	size_t		nbytes = view->ByteLength();
+	size_t		nelems;
+	size_t		size;
+	int			ndim = 1;
+	int			dims[MAXDIM];
+	ArrayType  *result;
+
+	/* One of our own array arguments of the same element type */
+	if (view->IsTypedArray())
+	{
+		Local<v8::Value> elemtype = view->GetInternalField(1);
+
+		if (elemtype->IsUint32() &&
+			elemtype.As<Uint32>()->Value() == type->typid)
+		{
+			ArrayType  *array = (ArrayType *) ExtractExternalArrayDatum(view);
+
+			if (type->typid == BOOLOID)
+				NormalizeBoolArray(array);
+			*datum = PointerGetDatum(array);
+			return true;
+		}
+	}
+
+	if (!type->ext_array)
+		return false;
+	if (view->IsDataView())
+	{
+		if (nbytes % type->len != 0)
+			throw js_error("DataView length is not a multiple of the array element size");
+	}
+	else if (!IsExternalArrayOf(view, type->ext_array))
+		return false;
+
+	nelems = nbytes / type->len;
+	if (nelems == 0)
+	{
+		*datum = PointerGetDatum(construct_empty_array(type->typid));
+		return true;
+	}
+	if (nelems > MaxArraySize)
+		throw js_error("array size exceeds the maximum allowed");
+	if (view->IsTypedArray())
+		ndim = GetArrayShape(view, nelems, dims);
+	else
+		dims[0] = nelems;
+
+	size = ARR_OVERHEAD_NONULLS(ndim) + nbytes;
+	result = (ArrayType *) palloc(size);
+	memset(result, 0, ARR_OVERHEAD_NONULLS(ndim));
+	SET_VARSIZE(result, size);
+	result->ndim = ndim;
+	result->dataoffset = 0;
+	result->elemtype = type->typid;
+	for (int i = 0; i < ndim; i++)
+	{
+		ARR_DIMS(result)[i] = dims[i];
+		ARR_LBOUND(result)[i] = 1;
+	}
+	view->CopyContents(ARR_DATA_PTR(result), nbytes);
+	if (type->typid == BOOLOID)
+		NormalizeBoolArray(result);
+
+	*datum = PointerGetDatum(result);
+	return true;
+}
+
+/*
+ * Convert the elements of nested arrays of the given dimensions, from
+ * dimension dim on, into values and nulls from *index.
+ */
+static void
+ToNestedArrayDatum(Handle<Object> array, int dim, int ndim, const int *dims,
+				   Datum *values, bool *nulls, int *index, plv8_type *type)
+{
+	Isolate	   *isolate = Isolate::GetCurrent();
+	Local<Context>	context = isolate->GetCurrentContext();
+
+	for (int i = 0; i < dims[dim]; i++)
+	{
+		Local<v8::Value>	elem = array->Get(context, i).ToLocalChecked();
+
+		if (dim + 1 < ndim)
+		{
+			if (!elem->IsArray() ||
+				Local<Array>::Cast(elem)->Length() != (uint32) dims[dim + 1])
+				throw js_error("multidimensional arrays must have sub-arrays with matching dimensions");
+			ToNestedArrayDatum(Local<Object>::Cast(elem), dim + 1, ndim, dims,
+							   values, nulls, index, type);
+		}
+		else
+		{
+			if (ndim > 1 && elem->IsArray())
+				throw js_error("multidimensional arrays must have sub-arrays with matching dimensions");
+			if (type->is_composite)
+				values[*index] = ToRecordDatum(elem, &nulls[*index], type);
+			else
+				values[*index] = ToScalarDatum(elem, &nulls[*index], type);
+			(*index)++;
+		}
+	}
+}
+
 static Datum
 ToArrayDatum(Handle<v8::Value> value, bool *isnull, plv8_type *type)
 {
-	int			length;
+	int64		nelems = 1;
+	int			index = 0;
 	Datum	   *values;
 	bool	   *nulls;
-	int			ndims[1];
-	int			lbs[] = {1};
+	int			ndim = 0;
+	int			dims[MAXDIM];
+	int			lbs[MAXDIM];
 	ArrayType  *result;
 	Isolate *isolate = Isolate::GetCurrent();
 	Local<Context>		context = isolate->GetCurrentContext();
@@ -857,32 +1264,65 @@ ToArrayDatum(Handle<v8::Value> value, bool *isnull, plv8_type *type)
 		return (Datum) 0;
 	}
 
-	void *datum_p = ExtractExternalArrayDatum(value);
-	if (datum_p)
+	if (value->IsArrayBufferView())
 	{
-		*isnull = false;
-		return PointerGetDatum(datum_p);
-	}
-
-	Handle<Array> array(Handle<Array>::Cast(value));
-	if (array.IsEmpty() || !array->IsArray())
-		throw js_error("value is not an Array");
+		Datum	datum;
 
-	length = array->Length();
-	values = (Datum *) palloc(sizeof(Datum) * length);
-	nulls = (bool *) palloc(sizeof(bool) * length);
-	ndims[0] = length;
-	for (int i = 0; i < length; i++) {
-		if (type->is_composite)
+		if (ArrayBufferViewToDatum(Local<ArrayBufferView>::Cast(value),
+								   type, &datum))
 		{
-			values[i] = ToRecordDatum(array->Get(context, i).ToLocalChecked(), &nulls[i], type);
-		} else {
-			values[i] = ToScalarDatum(array->Get(context, i).ToLocalChecked(), &nulls[i], type);
+			*isnull = false;
+			return datum;
 		}
 	}
 
-	result = construct_md_array(values, nulls, 1, ndims, lbs,
-				type->typid, type->len, type->byval, type->align);
+	/*
+	 * Nested arrays make a multi-dimensional array, whose dimensions are
+	 * the lengths of the first element at each level.  JSON elements may
+	 * be arrays themselves, so their arrays are never nested.  Typed
+	 * arrays of other element types are converted element-wise.
+	 */
+	Local<v8::Value> level = value;
+	bool		nested = (type->typid != JSONOID
+#if PG_VERSION_NUM >= 90400
+						  && type->typid != JSONBOID
+#endif
+						  );
+
+	while (ndim < MAXDIM)
+	{
+		int			length;
+
+		if (level->IsArray())
+			length = Local<Array>::Cast(level)->Length();
+		else if (ndim == 0 && level->IsTypedArray())
+			length = Local<TypedArray>::Cast(level)->Length();
+		else
+			break;
+
+		dims[ndim] = length;
+		lbs[ndim] = 1;
+		nelems *= length;
+		if (nelems > (int64) MaxArraySize)
+			throw js_error("array size exceeds the maximum allowed");
+		ndim++;
+		if (length == 0 || !nested)
+			break;
+		level = Local<Object>::Cast(level)->Get(context, 0).ToLocalChecked();
+	}
+	if (ndim == 0)
+		throw js_error("value is not an Array");
+
+	values = (Datum *) palloc(sizeof(Datum) * nelems);
+	nulls = (bool *) palloc(sizeof(bool) * nelems);
+	ToNestedArrayDatum(Local<Object>::Cast(value), 0, ndim, dims,
+					   values, nulls, &index, type);
+
+	if (nelems == 0)
+		result = construct_empty_array(type->typid);
+	else
+		result = construct_md_array(values, nulls, ndim, dims, lbs,
+					type->typid, type->len, type->byval, type->align);
 	pfree(values);
 	pfree(nulls);
 
@@ -936,6 +1376,310 @@ ToValue(Datum datum, bool isnull, plv8_type *type)
 		return ToScalarValue(datum, isnull, type);
 }
 
+/*
+ * The on-disk format of NUMERIC, which numeric.c keeps to itself.  It can't
+ * change between major versions, as pg_upgrade keeps the data files.
+ */
+#define PLV8_NUMERIC_SIGN_MASK				0xC000
+#define PLV8_NUMERIC_NEG					0x4000
+#define PLV8_NUMERIC_SHORT					0x8000
+#define PLV8_NUMERIC_SPECIAL				0xC000
+#define PLV8_NUMERIC_EXT_SIGN_MASK			0xF000
+#define PLV8_NUMERIC_PINF					0xD000
+#define PLV8_NUMERIC_NINF					0xF000
+#define PLV8_NUMERIC_DSCALE_MASK			0x3FFF
+#define PLV8_NUMERIC_SHORT_SIGN_MASK		0x2000
+#define PLV8_NUMERIC_SHORT_DSCALE_MASK		0x1F80
+#define PLV8_NUMERIC_SHORT_DSCALE_SHIFT		7
+#define PLV8_NUMERIC_SHORT_WEIGHT_SIGN_MASK	0x0040
+#define PLV8_NUMERIC_SHORT_WEIGHT_MASK		0x003F
+#define PLV8_NBASE							10000
+#define PLV8_DEC_DIGITS						4
+
+/*
+ * A NUMERIC value is sum(digits[i] * NBASE ^ (weight - i)), shown with
+ * dscale decimal digits after the point.  Digits may be unaligned.
+ */
+typedef struct plv8_numeric
+{
+	bool		special;		/* NaN or infinity, in value */
+	double		value;
+	bool		negative;
+	int			weight;
+	int			dscale;
+	int			ndigits;
+	const char *digits;
+} plv8_numeric;
+
+static void
+DecodeNumeric(Datum datum, plv8_numeric *num)
+{
+	struct varlena *p = PG_DETOAST_DATUM_PACKED(datum);
+	const char	   *data = VARDATA_ANY(p);
+	int				len = VARSIZE_ANY_EXHDR(p);
+	uint16			header;
+
+	memcpy(&header, data, sizeof(uint16));
+	memset(num, 0, sizeof(plv8_numeric));
+
+	if ((header & PLV8_NUMERIC_SIGN_MASK) == PLV8_NUMERIC_SPECIAL)
+	{
+		num->special = true;
+		if ((header & PLV8_NUMERIC_EXT_SIGN_MASK) == PLV8_NUMERIC_PINF)
+			num->value = std::numeric_limits<double>::infinity();
+		else if ((header & PLV8_NUMERIC_EXT_SIGN_MASK) == PLV8_NUMERIC_NINF)
+			num->value = -std::numeric_limits<double>::infinity();
+		else
+			num->value = std::numeric_limits<double>::quiet_NaN();
+	}
+	else if (header & PLV8_NUMERIC_SHORT)
+	{
+		num->negative = (header & PLV8_NUMERIC_SHORT_SIGN_MASK) != 0;
+		num->dscale = (header & PLV8_NUMERIC_SHORT_DSCALE_MASK) >> PLV8_NUMERIC_SHORT_DSCALE_SHIFT;
+		num->weight = ((header & PLV8_NUMERIC_SHORT_WEIGHT_SIGN_MASK) ?
+					   ~PLV8_NUMERIC_SHORT_WEIGHT_MASK : 0) |
+			(header & PLV8_NUMERIC_SHORT_WEIGHT_MASK);
+		num->digits = data + sizeof(uint16);
+		num->ndigits = (len - sizeof(uint16)) / sizeof(int16);
+	}
+	else
+	{
+		int16		weight;
+
+		memcpy(&weight, data + sizeof(uint16), sizeof(int16));
+		num->negative = (header & PLV8_NUMERIC_SIGN_MASK) == PLV8_NUMERIC_NEG;
+		num->dscale = header & PLV8_NUMERIC_DSCALE_MASK;
+		num->weight = weight;
+		num->digits = data + sizeof(uint16) + sizeof(int16);
+		num->ndigits = (len - sizeof(uint16) - sizeof(int16)) / sizeof(int16);
+	}
+}
+
+static inline int
+NumericDigit(const plv8_numeric *num, int i)
+{
+	int16		digit;
+
+	if (i < 0 || i >= num->ndigits)
+		return 0;
+	memcpy(&digit, num->digits + i * sizeof(int16), sizeof(int16));
+	return digit;
+}
+
+/*
+ * Formats the value as numeric_out does, into a palloc'd buffer.
+ */
+static char *
+NumericToCString(const plv8_numeric *num, int *len)
+{
+	char	   *buf;
+	char	   *cp;
+
+	if (num->special)
+	{
+		const char *str = std::isnan(num->value) ? "NaN" :
+			num->value > 0 ? "Infinity" : "-Infinity";
+
+		*len = strlen(str);
+		return pstrdup(str);
+	}
+
+	buf = cp = (char *) palloc(Max(num->weight + 1, 1) * PLV8_DEC_DIGITS +
+							   num->dscale + 3);
+	if (num->negative)
+		*cp++ = '-';
+
+	if (num->weight < 0)
+		*cp++ = '0';
+	for (int i = 0; i <= num->weight; i++)
+	{
+		int		digit = NumericDigit(num, i);
+
+		/* no leading zeros */
+		if (i == 0)
+		{
+			char	group[PLV8_DEC_DIGITS + 1];
+			int		n = snprintf(group, sizeof(group), "%d", digit);
+
+			memcpy(cp, group, n);
+			cp += n;
+			continue;
+		}
+		for (int d = PLV8_DEC_DIGITS - 1; d >= 0; d--)
+		{
+			cp[d] = '0' + digit % 10;
+			digit /= 10;
+		}
+		cp += PLV8_DEC_DIGITS;
+	}
+
+	if (num->dscale > 0)
+	{
+		*cp++ = '.';
+		for (int j = 0; j < num->dscale; j += PLV8_DEC_DIGITS)
+		{
+			int		digit = NumericDigit(num, num->weight + 1 + j / PLV8_DEC_DIGITS);
+			char	group[PLV8_DEC_DIGITS];
+
+			for (int d = PLV8_DEC_DIGITS - 1; d >= 0; d--)
+			{
+				group[d] = '0' + digit % 10;
+				digit /= 10;
+			}
+			for (int d = 0; d < PLV8_DEC_DIGITS && j + d < num->dscale; d++)
+				*cp++ = group[d];
+		}
+	}
+	*cp = '\0';
+	*len = cp - buf;
+	return buf;
+}
+
+/*
+ * Converts the value to a double if it has at most DBL_DIG significant
+ * digits, so that it converts back to the same value.  Values whose
+ * exponent is small enough take one correctly rounded operation on exact
+ * operands; the rest go through strtod.
+ */
+static bool
+NumericToDouble(const plv8_numeric *num, double *result)
+{
+	static const double	pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	int			first;
+	int			last;
+	int			trailing = 0;
+	int			exponent;
+	int64		mantissa = 0;
+
+	if (num->special)
+	{
+		*result = num->value;
+		return true;
+	}
+	if (num->ndigits == 0)
+	{
+		*result = 0;
+		return true;
+	}
+
+	first = NumericDigit(num, 0);
+	last = NumericDigit(num, num->ndigits - 1);
+	while (last % 10 == 0)
+	{
+		last /= 10;
+		trailing++;
+	}
+	if ((first >= 1000 ? 4 : first >= 100 ? 3 : first >= 10 ? 2 : 1) +
+		(num->ndigits - 1) * PLV8_DEC_DIGITS - trailing > DBL_DIG)
+		return false;
+
+	/* At most 15 significant digits in at most 5 groups fit in an int64 */
+	for (int i = 0; i < num->ndigits; i++)
+		mantissa = mantissa * PLV8_NBASE + NumericDigit(num, i);
+	for (int i = 0; i < trailing; i++)
+		mantissa /= 10;
+	exponent = (num->weight - num->ndigits + 1) * PLV8_DEC_DIGITS + trailing;
+
+	if (exponent >= 0 && exponent < (int) lengthof(pow10))
+		*result = (double) mantissa * pow10[exponent];
+	else if (exponent < 0 && -exponent < (int) lengthof(pow10))
+		*result = (double) mantissa / pow10[-exponent];
+	else
+	{
+		char	   *str;
+		int			len;
+
+		str = NumericToCString(num, &len);
+		*result = strtod(str, NULL);
+		pfree(str);
+		if (std::isinf(*result) || *result == 0)
+			return false;
+		return true;
+	}
+	if (num->negative)
+		*result = -*result;
+	return true;
+}
+
+static Local<v8::Value>
+NumericToBigInt(const plv8_numeric *num)
+{
+	Isolate			   *isolate = Isolate::GetCurrent();
+	std::vector<uint32>	limbs;
+	std::vector<uint64_t> words;
+
+	/* Up to 16 decimal digits fit in an int64 */
+	if (num->weight < PLV8_DEC_DIGITS)
+	{
+		int64		value = 0;
+
+		for (int i = 0; i <= num->weight; i++)
+			value = value * PLV8_NBASE + NumericDigit(num, i);
+		return BigInt::New(isolate, num->negative ? -value : value);
+	}
+
+	for (int i = 0; i <= num->weight; i++)
+	{
+		uint64		carry = NumericDigit(num, i);
+
+		for (auto &limb : limbs)
+		{
+			uint64		t = (uint64) limb * PLV8_NBASE + carry;
+
+			limb = (uint32) t;
+			carry = t >> 32;
+		}
+		if (carry)
+			limbs.push_back((uint32) carry);
+	}
+	for (size_t i = 0; i < limbs.size(); i += 2)
+		words.push_back(limbs[i] |
+			(i + 1 < limbs.size() ? (uint64_t) limbs[i + 1] << 32 : 0));
+
+	return BigInt::NewFromWords(isolate->GetCurrentContext(), num->negative,
+								words.size(), words.data()).ToLocalChecked();
+}
+
+static Local<v8::Value>
+NumericToValue(Datum datum)
+{
+	Isolate		   *isolate = Isolate::GetCurrent();
+	plv8_numeric	num;
+	double			value;
+	char		   *str;
+	int				len;
+
+	if (plv8_numeric_conversion == PLV8_NUMERIC_FLOAT)
+		return Number::New(isolate, DatumGetFloat8(
+			DirectFunctionCall1(numeric_float8, datum)));
+
+	DecodeNumeric(datum, &num);
+	switch (plv8_numeric_conversion)
+	{
+	case PLV8_NUMERIC_EXACT:
+		if (NumericToDouble(&num, &value))
+			return Number::New(isolate, value);
+		break;
+	case PLV8_NUMERIC_BIGINT:
+		if (num.special)
+			return Number::New(isolate, num.value);
+		if (num.dscale == 0)
+			return NumericToBigInt(&num);
+		break;
+	default:
+		break;
+	}
+
+	str = NumericToCString(&num, &len);
+	Local<v8::String>	result = v8::String::NewFromOneByte(isolate,
+			(const uint8_t *) str, NewStringType::kNormal, len).ToLocalChecked();
+	pfree(str);
+	return result;
+}
+
 static Local<v8::Value>
 ToScalarValue(Datum datum, bool isnull, plv8_type *type)
 {
@@ -966,8 +1710,7 @@ ToScalarValue(Datum datum, bool isnull, plv8_type *type)
 	case FLOAT8OID:
 		return Number::New(isolate, DatumGetFloat8(datum));
 	case NUMERICOID:
-		return Number::New(isolate, DatumGetFloat8(
-			DirectFunctionCall1(numeric_float8, datum)));
+		return NumericToValue(datum);
 	case DATEOID:
 		return Date::New(isolate->GetCurrentContext(), DateToEpoch(DatumGetDateADT(datum))).ToLocalChecked();
 	case TIMESTAMPOID:
@@ -978,10 +1721,42 @@ ToScalarValue(Datum datum, bool isnull, plv8_type *type)
 	case BPCHAROID:
 	case XMLOID:
 	{
-		void	   *p = PG_DETOAST_DATUM_PACKED(datum);
+		bool		large = toast_raw_datum_size(datum) >= PLV8_EXTERNAL_STRING_SIZE + VARHDRSZ &&
+			!(current_context && current_context->building_snapshot);
+		bool		external = false;
+		void	   *p;
+
+		/*
+		 * Large ASCII text is read in place by V8 rather than copied to its
+		 * heap.  Large text that must be detoasted anyway is detoasted into
+		 * the long-lived context; text already in memory is copied there
+		 * only once it is known to be ASCII.  Others are converted as usual.
+		 */
+		if (large && VARATT_IS_EXTENDED(DatumGetPointer(datum)))
+		{
+			p = DetoastExternalDatum(datum);
+			external = true;
+		}
+		else
+			p = PG_DETOAST_DATUM_PACKED(datum);
+
 		const char *str = VARDATA_ANY(p);
 		int			len = VARSIZE_ANY_EXHDR(p);
 
+		if (large && IsAscii(str, len))
+		{
+			void	   *ext = external ? p : DetoastExternalDatum(datum);
+			ExternalTextResource *resource = new ExternalTextResource(ext);
+			MaybeLocal<v8::String>	result =
+				v8::String::NewExternalOneByte(isolate, resource);
+
+			if (!result.IsEmpty())
+				return result.ToLocalChecked();
+			delete resource;
+			if (!external)
+				pfree(ext);
+		}
+
 		Local<v8::String>	result = ToString(str, len);
 
 		if (p != DatumGetPointer(datum))
@@ -990,12 +1765,13 @@ ToScalarValue(Datum datum, bool isnull, plv8_type *type)
 	}
 	case BYTEAOID:
 	{
-		void	   *p = PG_DETOAST_DATUM_COPY(datum);
+		void	   *p = DetoastExternalDatum(datum);
 
 		return CreateExternalArray(VARDATA_ANY(p),
 								   kExternalUnsignedByteArray,
 								   VARSIZE_ANY_EXHDR(p),
-								   PointerGetDatum(p));
+								   PointerGetDatum(p),
+								   InvalidOid);
 	}
 #if PG_VERSION_NUM >= 90200
 	case JSONOID:
@@ -1040,6 +1816,88 @@ ToScalarValue(Datum datum, bool isnull, plv8_type *type)
 	}
 }
 
+/*
+ * Convert the deconstructed elements of an array, going straight to the
+ * value for the most common element types.
+ */
+static void
+ToArrayElementValues(Datum *values, bool *nulls, int nelems,
+					 plv8_type *base, Local<v8::Value> *elems)
+{
+	Isolate	   *isolate = Isolate::GetCurrent();
+	Local<v8::Value>	null = Null(isolate);
+
+	switch (base->typid)
+	{
+	case BOOLOID:
+		for (int i = 0; i < nelems; i++)
+			elems[i] = nulls[i] ? null :
+				v8::Boolean::New(isolate, DatumGetBool(values[i]));
+		break;
+	case INT2OID:
+		for (int i = 0; i < nelems; i++)
+			elems[i] = nulls[i] ? null :
+				Int32::New(isolate, DatumGetInt16(values[i]));
+		break;
+	case INT4OID:
+		for (int i = 0; i < nelems; i++)
+			elems[i] = nulls[i] ? null :
+				Int32::New(isolate, DatumGetInt32(values[i]));
+		break;
+	case FLOAT8OID:
+		for (int i = 0; i < nelems; i++)
+			elems[i] = nulls[i] ? null :
+				Number::New(isolate, DatumGetFloat8(values[i]));
+		break;
+	case TEXTOID:
+	case VARCHAROID:
+	case BPCHAROID:
+		/* Array elements are never compressed or out of line. */
+		for (int i = 0; i < nelems; i++)
+		{
+			if (nulls[i])
+				elems[i] = null;
+			else
+			{
+				void	   *p = DatumGetPointer(values[i]);
+
+				elems[i] = ToString(VARDATA_ANY(p), VARSIZE_ANY_EXHDR(p));
+			}
+		}
+		break;
+	default:
+		for (int i = 0; i < nelems; i++)
+			elems[i] = ToValue(values[i], nulls[i], base);
+		break;
+	}
+}
+
+/*
+ * Build the nested arrays of a multi-dimensional array from dimension dim
+ * on, taking the converted elements in order from *index.
+ */
+static Local<Array>
+ToNestedArrayValue(int dim, int ndim, const int *dims,
+				   Local<v8::Value> *elems, int *index)
+{
+	Isolate	   *isolate = Isolate::GetCurrent();
+
+	if (dim + 1 == ndim)
+	{
+		Local<Array>	result = Array::New(isolate, &elems[*index], dims[dim]);
+
+		*index += dims[dim];
+		return result;
+	}
+
+	std::vector<Local<v8::Value>>	subarrays(dims[dim]);
+
+	for (int i = 0; i < dims[dim]; i++)
+		subarrays[i] = ToNestedArrayValue(dim + 1, ndim, dims, elems, index);
+
+	return Array::New(isolate, subarrays.data(), dims[dim]);
+}
+
 static Local<v8::Value>
 ToArrayValue(Datum datum, bool isnull, plv8_type *type)
 {
@@ -1049,47 +1907,85 @@ ToArrayValue(Datum datum, bool isnull, plv8_type *type)
 	Isolate *isolate = Isolate::GetCurrent();
 	Local<Context>		context = isolate->GetCurrentContext();
 
+	ArrayType  *array = DatumGetArrayTypeP(datum);
+	int			ndim = ARR_NDIM(array);
+
 	/*
-	 * If we can use an external array, do it instead.
+	 * If we can use an external array, do it instead.  We allow only
+	 * non-NULL, 1-dim array for the domains.  Other arrays may have any
+	 * number of dimensions, which are given in the shape property, and fall
+	 * back to a regular Array when they have NULLs.
 	 */
-	if (type->ext_array)
+	if (type->ext_array && (type->ext_array_domain || plv8_typed_arrays))
 	{
-		ArrayType   *array = DatumGetArrayTypePCopy(datum);
-
-		/*
-		 * We allow only non-NULL, 1-dim array.
-		 */
-		if (!ARR_HASNULL(array) && ARR_NDIM(array) <= 1)
+		if (!ARR_HASNULL(array) && (ndim <= 1 || !type->ext_array_domain))
 		{
-			int			data_bytes = ARR_SIZE(array) -
-										ARR_OVERHEAD_NONULLS(1);
-			return CreateExternalArray(ARR_DATA_PTR(array),
+			ArrayType  *copy = (ArrayType *)
+				DetoastExternalDatum(PointerGetDatum(array));
+			int			data_bytes = ARR_SIZE(copy) -
+										ARR_DATA_OFFSET(copy);
+			int		   *dims = ARR_DIMS(copy);
+
+			if (array != (ArrayType *) DatumGetPointer(datum))
+				pfree(array);
+
+			Local<Object> result = CreateExternalArray(ARR_DATA_PTR(copy),
 									   type->ext_array,
 									   data_bytes,
-									   PointerGetDatum(array));
+									   PointerGetDatum(copy),
+									   ARR_ELEMTYPE(copy));
+
+			if (ndim > 1 && !result.IsEmpty())
+			{
+				Local<Array> shape = Array::New(isolate, ndim);
+
+				for (int i = 0; i < ndim; i++)
+					shape->Set(context, i, Int32::New(isolate, dims[i])).Check();
+				result->Set(context, v8::String::NewFromUtf8Literal(isolate, "shape"),
+							shape).Check();
+			}
+			return result;
 		}
 
-		throw js_error("NULL element, or multi-dimension array not allowed"
-						" in external array type");
+		if (type->ext_array_domain)
+			throw js_error("NULL element, or multi-dimension array not allowed"
+							" in external array type");
 	}
 
-	deconstruct_array(DatumGetArrayTypeP(datum),
+	deconstruct_array(array,
 						type->typid, type->len, type->byval, type->align,
 						&values, &nulls, &nelems);
-	Local<Array>  result = Array::New(Isolate::GetCurrent(), nelems);
-	plv8_type base = { 0 };
-	bool    ispreferred;
+	Local<Array>  result;
+	plv8_type  *base = type->elem;
+	plv8_type	local_base = { 0 };
+
+	/* The element type is filled in by plv8_fill_type. */
+	if (base == NULL)
+	{
+		bool    ispreferred;
 
-	base.typid = type->typid;
-	if (base.typid == RECORDARRAYOID)
-		base.typid = RECORDOID;
+		base = &local_base;
+		base->typid = type->typid;
+		if (base->typid == RECORDARRAYOID)
+			base->typid = RECORDOID;
 
-	base.fn_input.fn_mcxt = base.fn_output.fn_mcxt = type->fn_input.fn_mcxt;
-	get_type_category_preferred(base.typid, &(base.category), &ispreferred);
-	get_typlenbyvalalign(base.typid, &(base.len), &(base.byval), &(base.align));
+		base->fn_input.fn_mcxt = base->fn_output.fn_mcxt = type->fn_input.fn_mcxt;
+		get_type_category_preferred(base->typid, &(base->category), &ispreferred);
+		get_typlenbyvalalign(base->typid, &(base->len), &(base->byval), &(base->align));
+	}
 
-	for (int i = 0; i < nelems; i++)
-		result->Set(context, i, ToValue(values[i], nulls[i], &base)).Check();
+	std::vector<Local<v8::Value>>	elems(nelems);
+
+	ToArrayElementValues(values, nulls, nelems, base, elems.data());
+	if (ndim > 1)
+	{
+		int			index = 0;
+
+		result = ToNestedArrayValue(0, ndim, ARR_DIMS(array), elems.data(),
+									&index);
+	}
+	else
+		result = Array::New(isolate, elems.data(), nelems);
 
 	pfree(values);
 	pfree(nulls);
@@ -0,0 +1,20 @@
+SET plv8.code_cache = on;
+-- the validator compiles the function and stores its code cache
+CREATE FUNCTION code_cache_add(a int, b int) RETURNS int AS $$
+  return a + b;
+$$ LANGUAGE plv8;
+-- a new context loads it from there
+SELECT plv8_reset();
+SELECT code_cache_add(1, 2);
+SELECT plv8_info()->0->'code_cache' AS code_cache;
+-- the least recently used files are removed beyond plv8.code_cache_size
+SET plv8.code_cache_size = 1;
+CREATE FUNCTION code_cache_mul(a int, b int) RETURNS int AS $$
+  return a * b;
+$$ LANGUAGE plv8;
+SELECT coalesce(sum((pg_stat_file('plv8/code_cache/' || f)).size), 0) <= 1024 AS capped
+  FROM pg_ls_dir('plv8/code_cache') f;
+RESET plv8.code_cache_size;
+RESET plv8.code_cache;
+DROP FUNCTION code_cache_add(int, int);
+DROP FUNCTION code_cache_mul(int, int);
@@ -0,0 +1,27 @@
+CREATE ROLE context_a;
+CREATE ROLE context_b;
+
+-- keep one context, the least recently used one makes room
+SET plv8.max_contexts = 1;
+SET ROLE context_a;
+DO $$ plv8.elog(NOTICE, 'a') $$ LANGUAGE plv8;
+SET ROLE context_b;
+DO $$ plv8.elog(NOTICE, 'b') $$ LANGUAGE plv8;
+SET ROLE context_a;
+DO $$ plv8.elog(NOTICE, 'a again') $$ LANGUAGE plv8;
+RESET ROLE;
+SELECT e->>'user' AS user, e->>'evictions' AS evictions, e->>'recreations' AS recreations
+  FROM json_array_elements(plv8_info()) e;
+RESET plv8.max_contexts;
+
+-- with an idle timeout, the contexts the ending transaction used are kept
+SET plv8.context_idle_timeout = 1;
+SET ROLE context_b;
+DO $$ plv8.elog(NOTICE, 'b again') $$ LANGUAGE plv8;
+RESET ROLE;
+SELECT count(*) AS kept FROM json_array_elements(plv8_info()) e
+  WHERE e->>'user' = 'context_b';
+RESET plv8.context_idle_timeout;
+
+DROP ROLE context_a;
+DROP ROLE context_b;
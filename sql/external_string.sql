@@ -0,0 +1,28 @@
+-- text of 64kB or more is read in place when it is ASCII
+CREATE FUNCTION text_info(t text) RETURNS text AS $$
+  return t.length + ' ' + t.slice(0, 3) + ' ' + t.slice(-3);
+$$ LANGUAGE plv8;
+CREATE FUNCTION text_echo(t text) RETURNS text AS $$
+  return t;
+$$ LANGUAGE plv8;
+CREATE FUNCTION text_keep(t text) RETURNS void AS $$
+  globalThis.kept_text = t;
+$$ LANGUAGE plv8;
+
+CREATE TABLE large_text (t text);
+INSERT INTO large_text VALUES
+  ('abc' || repeat('x', 100000) || 'xyz'),
+  (repeat('ab', 40000)::varchar),
+  (chr(233) || repeat('x', 70000) || chr(252)),
+  ('short');
+
+-- the large rows are stored compressed, and one of them is not ASCII
+SELECT octet_length(t) = char_length(t) AS ascii, pg_column_size(t) < octet_length(t) AS compressed
+  FROM large_text WHERE octet_length(t) >= 65536;
+SELECT text_info(t) FROM large_text;
+SELECT text_info(repeat(chr(233), 40000));
+SELECT md5(text_echo(t)) = md5(t) AS same FROM large_text;
+SELECT text_keep(t) FROM large_text WHERE t LIKE 'abc%';
+DO $$ plv8.elog(NOTICE, kept_text.length); $$ LANGUAGE plv8;
+
+DROP TABLE large_text;
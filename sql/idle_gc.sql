@@ -0,0 +1,16 @@
+-- garbage left by a transaction is collected after it ends
+SET plv8.idle_gc_time = 100;
+CREATE TEMP TABLE idle_gc_heap (n serial, used float8);
+DO $$
+  var junk = [];
+  for (var i = 0; i < 100000; i++) junk.push({ i: i, s: 'x' + i });
+  junk = null;
+  plv8.execute('INSERT INTO idle_gc_heap (used) VALUES ($1)', [plv8.memory_usage().used_heap_size]);
+$$ LANGUAGE plv8;
+DO $$
+  plv8.execute('INSERT INTO idle_gc_heap (used) VALUES ($1)', [plv8.memory_usage().used_heap_size]);
+$$ LANGUAGE plv8;
+SELECT a.used > b.used AS collected
+  FROM idle_gc_heap a, idle_gc_heap b WHERE a.n = 1 AND b.n = 2;
+RESET plv8.idle_gc_time;
+DROP TABLE idle_gc_heap;
@@ -0,0 +1,8 @@
+-- statement_timeout must stop long-running JavaScript
+SET statement_timeout = '200ms';
+DO $$ while (true) {} $$ LANGUAGE plv8;
+CREATE FUNCTION spin() RETURNS void AS $$ while (true) {} $$ LANGUAGE plv8;
+SELECT spin();
+RESET statement_timeout;
+SELECT 'alive' AS status;
+DROP FUNCTION spin();
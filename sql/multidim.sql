@@ -0,0 +1,56 @@
+CREATE FUNCTION array_json(a anyarray) RETURNS text AS $$
+  return JSON.stringify(a);
+$$ LANGUAGE plv8;
+CREATE FUNCTION int_matrix(rows int, cols int) RETURNS int[] AS $$
+  var m = [];
+  for (var i = 0; i < rows; i++) {
+    m.push([]);
+    for (var j = 0; j < cols; j++)
+      m[i].push(i * cols + j);
+  }
+  return m;
+$$ LANGUAGE plv8;
+CREATE FUNCTION text_roundtrip(a text[]) RETURNS text[] AS $$
+  return a;
+$$ LANGUAGE plv8;
+CREATE FUNCTION json_array(a json) RETURNS json[] AS $$
+  return [a, a];
+$$ LANGUAGE plv8;
+
+SELECT array_json('{{1,2,3},{4,5,6}}'::int[]);
+SELECT array_json('{{{a,NULL}},{{c,d}}}'::text[]);
+SELECT array_json('[0:1][2:3]={{1,2},{3,4}}'::float8[]);
+SELECT int_matrix(2, 3), int_matrix(3, 1), int_matrix(0, 2);
+SELECT text_roundtrip('{{a,b},{NULL,"c d"}}'), array_dims(text_roundtrip('{{{x}}}'));
+-- JSON elements are never nested
+SELECT json_array('[1, [2]]');
+
+-- sub-arrays must match
+CREATE FUNCTION ragged() RETURNS int[] AS $$
+  return [[1, 2], [3]];
+$$ LANGUAGE plv8;
+SELECT ragged();
+CREATE FUNCTION mixed() RETURNS int[] AS $$
+  return [[1, 2], 3];
+$$ LANGUAGE plv8;
+SELECT mixed();
+
+-- typed arrays with a shape
+SET plv8.typed_arrays = on;
+CREATE FUNCTION transpose(m float8[]) RETURNS float8[] AS $$
+  var rows = m.shape[0], cols = m.shape[1];
+  var t = new Float64Array(m.length);
+  for (var i = 0; i < rows; i++)
+    for (var j = 0; j < cols; j++)
+      t[j * rows + i] = m[i * cols + j];
+  t.shape = [cols, rows];
+  return t;
+$$ LANGUAGE plv8;
+SELECT transpose('{{1,2,3},{4,5,6}}');
+CREATE FUNCTION bad_shape() RETURNS float8[] AS $$
+  var a = new Float64Array(6);
+  a.shape = [4, 2];
+  return a;
+$$ LANGUAGE plv8;
+SELECT bad_shape();
+RESET plv8.typed_arrays;
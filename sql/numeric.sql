@@ -0,0 +1,24 @@
+CREATE FUNCTION numeric_js(n numeric) RETURNS text AS $$
+  return typeof n + ' ' + String(n);
+$$ LANGUAGE plv8;
+CREATE FUNCTION numeric_roundtrip(n numeric) RETURNS numeric AS $$
+  return n;
+$$ LANGUAGE plv8;
+CREATE TABLE numeric_values (n numeric);
+INSERT INTO numeric_values VALUES (0), (12.34), (-123456), (0.000012), (1e20),
+  (12345678901234567890.123456789), ('NaN');
+
+SELECT n, numeric_js(n), numeric_roundtrip(n) FROM numeric_values;
+
+SET plv8.numeric_conversion = 'exact';
+SELECT n, numeric_js(n), numeric_roundtrip(n) FROM numeric_values;
+
+SET plv8.numeric_conversion = 'bigint';
+SELECT n, numeric_js(n), numeric_roundtrip(n) FROM numeric_values;
+
+SET plv8.numeric_conversion = 'string';
+SELECT n, numeric_js(n), numeric_roundtrip(n) FROM numeric_values;
+SELECT numeric_js(n) FROM unnest('{1.50,-0.5}'::numeric[]) n;
+
+RESET plv8.numeric_conversion;
+DROP TABLE numeric_values;
@@ -193,6 +193,17 @@ $$
 LANGUAGE plv8 IMMUTABLE STRICT;
 SELECT fastsum(ARRAY[1, 2, 3, 4, 5]);
 SELECT fastsum(ARRAY[NULL, 2]);
+CREATE FUNCTION scale(ary plv8_float8array, k float8) RETURNS plv8_float8array AS
+$$
+    for (var i = 0; i < ary.length; i++) {
+      ary[i] *= k;
+    }
+    globalThis.kept = ary;
+    return ary;
+$$
+LANGUAGE plv8 IMMUTABLE STRICT;
+SELECT scale(ARRAY[1, 2.5, 3], 2);
+DO $$ plv8.elog(NOTICE, globalThis.kept.join(',')); $$ LANGUAGE plv8;
 
 -- elog()
 CREATE FUNCTION test_elog(arg text) RETURNS void AS
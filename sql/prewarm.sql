@@ -0,0 +1,44 @@
+CREATE SCHEMA prewarm_test;
+CREATE FUNCTION prewarm_test.good(a int) RETURNS int AS $$
+	return a + 1;
+$$ LANGUAGE plv8;
+SET check_function_bodies = off;
+CREATE FUNCTION prewarm_test.broken() RETURNS int AS $$
+	return (
+$$ LANGUAGE plv8;
+RESET check_function_bodies;
+
+SELECT plv8_reset();
+SELECT plv8_prewarm('prewarm_test')::jsonb - 'elapsed_ms' AS result;
+SELECT plv8_prewarm('no_such_schema')::jsonb - 'elapsed_ms' AS result;
+SELECT prewarm_test.good(1);
+
+-- compile when the context is created
+SET plv8.prewarm = 'prewarm_test';
+SELECT plv8_reset();
+DO $$ plv8.elog(NOTICE, 'context created') $$ LANGUAGE plv8;
+RESET plv8.prewarm;
+
+-- prewarming another role needs its privileges
+CREATE ROLE prewarm_a;
+CREATE ROLE prewarm_b;
+SET ROLE prewarm_b;
+SELECT plv8_prewarm('prewarm_test', 'prewarm_a');
+RESET ROLE;
+DROP ROLE prewarm_a;
+DROP ROLE prewarm_b;
+
+-- a body closing the function early is rejected without running anything
+CREATE SCHEMA prewarm_escape;
+SET check_function_bodies = off;
+CREATE FUNCTION prewarm_escape.escape() RETURNS int AS $$
+	return 1;
+}); for (;;) {} (function () {
+$$ LANGUAGE plv8;
+RESET check_function_bodies;
+SET statement_timeout = '5s';
+SELECT plv8_prewarm('prewarm_escape')::jsonb - 'elapsed_ms' AS result;
+RESET statement_timeout;
+DROP SCHEMA prewarm_escape CASCADE;
+
+DROP SCHEMA prewarm_test CASCADE;
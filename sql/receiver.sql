@@ -0,0 +1,40 @@
+-- `this` is kept across transactions
+CREATE FUNCTION count_calls() RETURNS int AS $$
+  this.calls = (this.calls || 0) + 1;
+  return this.calls;
+$$ LANGUAGE plv8;
+SELECT count_calls();
+SELECT count_calls();
+BEGIN;
+SELECT count_calls();
+ROLLBACK;
+SELECT count_calls();
+-- replacing the function starts over
+CREATE OR REPLACE FUNCTION count_calls() RETURNS int AS $$
+  this.calls = (this.calls || 0) + 1;
+  return this.calls * 10;
+$$ LANGUAGE plv8;
+SELECT count_calls();
+SELECT count_calls();
+-- so does resetting the context
+SELECT plv8_reset();
+SELECT count_calls();
+-- each user keeps its own compiled function
+CREATE ROLE receiver_other;
+SET ROLE receiver_other;
+SELECT count_calls();
+RESET ROLE;
+SELECT count_calls();
+SET ROLE receiver_other;
+SELECT count_calls();
+RESET ROLE;
+DROP ROLE receiver_other;
+-- an evicted function starts over, even at a call site that used it before
+CREATE FUNCTION other_calls() RETURNS int AS $$
+  return 0;
+$$ LANGUAGE plv8;
+SET plv8.function_cache_size = 1;
+SELECT count_calls() + other_calls() FROM generate_series(1, 3);
+RESET plv8.function_cache_size;
+DROP FUNCTION other_calls();
+DROP FUNCTION count_calls();
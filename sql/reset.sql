@@ -11,3 +11,22 @@ SELECT test_context_value();
 
 SELECT plv8_reset();
 SELECT test_context_value();
+
+-- keep the isolate, only the global context is replaced
+SELECT set_context_value('test');
+SELECT plv8_reset(true);
+SELECT test_context_value();
+SELECT set_context_value('again');
+SELECT test_context_value();
+
+-- a context can't be reset while it runs code
+CREATE FUNCTION reset_in_use(keep bool) RETURNS void AS $$
+try {
+	plv8.execute('SELECT plv8_reset($1)', [keep]);
+} catch (e) {
+	plv8.elog(NOTICE, e);
+}
+$$ LANGUAGE plv8;
+SELECT reset_in_use(false);
+SELECT reset_in_use(true);
+DROP FUNCTION reset_in_use(bool);
@@ -0,0 +1,63 @@
+-- the start up procedure is baked into the snapshot
+CREATE TABLE snapshot_log (n int);
+CREATE FUNCTION snapshot_init() RETURNS void AS $$
+	plv8.execute('INSERT INTO snapshot_log VALUES (1)');
+	this.greeting = 'hello';
+$$ LANGUAGE plv8;
+CREATE FUNCTION snapshot_greeting() RETURNS text AS $$
+	return greeting;
+$$ LANGUAGE plv8;
+
+SET plv8.start_proc = 'snapshot_init';
+SELECT plv8_build_snapshot();
+SELECT count(*) FROM snapshot_log;
+
+-- restored from the snapshot, without running the start up procedure again
+SELECT plv8_reset();
+SELECT snapshot_greeting();
+SELECT count(*) FROM snapshot_log;
+
+-- a snapshot is only restored for the role it was built for
+CREATE ROLE snapshot_user;
+GRANT INSERT ON snapshot_log TO snapshot_user;
+SET ROLE snapshot_user;
+SELECT snapshot_greeting();
+RESET ROLE;
+SELECT count(*) FROM snapshot_log;
+SELECT plv8_build_snapshot('snapshot_user');
+SELECT count(*) FROM snapshot_log;
+SET ROLE snapshot_user;
+SELECT plv8_reset();
+SELECT snapshot_greeting();
+RESET ROLE;
+SELECT count(*) FROM snapshot_log;
+
+-- a changed start up procedure makes the snapshot stale
+CREATE OR REPLACE FUNCTION snapshot_init() RETURNS void AS $$
+	plv8.execute('INSERT INTO snapshot_log VALUES (2)');
+	this.greeting = 'hello again';
+$$ LANGUAGE plv8;
+SELECT plv8_reset();
+SELECT snapshot_greeting();
+SELECT count(*) FROM snapshot_log;
+
+-- plans can't be kept in a snapshot
+CREATE OR REPLACE FUNCTION snapshot_init() RETURNS void AS $$
+	this.plan = plv8.prepare('SELECT 1');
+$$ LANGUAGE plv8;
+SELECT plv8_build_snapshot();
+
+RESET plv8.start_proc;
+-- the context running the code can't be replaced
+DO $$
+try {
+	plv8.execute('SELECT plv8_build_snapshot()');
+} catch (e) {
+	plv8.elog(NOTICE, e);
+}
+$$ LANGUAGE plv8;
+SELECT plv8_reset();
+DROP FUNCTION snapshot_greeting();
+DROP FUNCTION snapshot_init();
+DROP TABLE snapshot_log;
+DROP ROLE snapshot_user;
@@ -0,0 +1,63 @@
+CREATE FUNCTION array_kind(a anyarray) RETURNS text AS $$
+  var kind = Object.prototype.toString.call(a).slice(8, -1);
+  return a.shape ? kind + ' ' + JSON.stringify(a.shape) : kind;
+$$ LANGUAGE plv8;
+CREATE FUNCTION double_all(a float8[]) RETURNS float8[] AS $$
+  for (var i = 0; i < a.length; i++)
+    a[i] *= 2;
+  return a;
+$$ LANGUAGE plv8;
+CREATE FUNCTION int8_sum(a int8[]) RETURNS int8 AS $$
+  var sum = 0n;
+  for (var i = 0; i < a.length; i++)
+    sum += a[i];
+  return sum;
+$$ LANGUAGE plv8;
+
+-- off by default
+SELECT array_kind('{1,2}'::int4[]);
+
+SET plv8.typed_arrays = on;
+SELECT array_kind('{t,f}'::bool[]), array_kind('{1,2}'::int2[]),
+  array_kind('{1,2}'::int4[]), array_kind('{1,2}'::int8[]);
+SELECT array_kind('{1.5}'::float4[]), array_kind('{1.5}'::float8[]),
+  array_kind('{1.5}'::numeric[]), array_kind('{a}'::text[]);
+SELECT array_kind('{{1,2,3},{4,5,6}}'::int4[]), array_kind('{}'::int4[]);
+-- NULL elements give a regular array
+SELECT array_kind('{1,NULL}'::int4[]);
+SELECT double_all('{1,2.5,3}'), double_all('[0:1][1:2]={{1,2},{3,4}}');
+SELECT int8_sum('{1,2,9007199254740993}');
+CREATE FUNCTION bool_set(a bool[]) RETURNS bool[] AS $$
+  a[0] = 5;
+  return a;
+$$ LANGUAGE plv8;
+SELECT bool_set('{f,f}');
+-- views passed back for another element type are converted element-wise
+CREATE FUNCTION int4_to_float8(a int4[]) RETURNS float8[] AS $$
+  return a;
+$$ LANGUAGE plv8;
+SELECT int4_to_float8('{1,2,3}');
+
+RESET plv8.typed_arrays;
+
+-- typed arrays and DataViews made in JavaScript are copied as they are
+CREATE FUNCTION typed_result(kind text) RETURNS float8[] AS $$
+  var a = new Float64Array([1.5, 2, -3]);
+  switch (kind) {
+    case 'typed': return a;
+    case 'sub': return a.subarray(1);
+    case 'view': return new DataView(a.buffer);
+    case 'short': return new DataView(a.buffer, 0, 12);
+    case 'empty': return new Float64Array(0);
+    case 'int': return new Int32Array([4, 5]);
+  }
+$$ LANGUAGE plv8;
+SELECT typed_result('typed'), typed_result('sub'), typed_result('view'),
+  typed_result('empty'), typed_result('int');
+SELECT typed_result('short');
+CREATE FUNCTION typed_results() RETURNS TABLE (b bool[], s int2[], i int4[], l int8[], f float4[]) AS $$
+  plv8.return_next({ b: new Uint8Array([0, 1, 2]), s: new Int16Array([-1, 2]),
+                     i: new Int32Array([2147483647]), l: new BigInt64Array([-9007199254740993n]),
+                     f: new Float32Array([0.5, 0.25]) });
+$$ LANGUAGE plv8;
+SELECT * FROM typed_results();
@@ -0,0 +1,46 @@
+# Transaction end in a backend that preloaded plv8 but never ran it, so V8
+# is not initialized yet.
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('preload');
+$node->init;
+$node->start;
+
+# The library is named after the extension version
+my $version = $node->safe_psql('postgres',
+	"SELECT default_version FROM pg_available_extensions WHERE name = 'plv8'");
+$node->append_conf('postgresql.conf',
+	"shared_preload_libraries = 'plv8-$version'");
+$node->restart;
+
+$node->safe_psql('postgres', 'CREATE EXTENSION plv8');
+
+my $result = $node->safe_psql(
+	'postgres', q{
+SET plv8.idle_gc_time = 10;
+SET plv8.context_idle_timeout = 1;
+BEGIN;
+SELECT 1;
+COMMIT;
+BEGIN;
+ROLLBACK;
+SELECT 2;
+});
+is($result, "1\n2", 'transaction end before plv8 is used');
+
+$result = $node->safe_psql(
+	'postgres', q{
+SET plv8.idle_gc_time = 10;
+DO $$ plv8.elog(NOTICE, 'used') $$ LANGUAGE plv8;
+SELECT plv8_version() IS NOT NULL;
+});
+is($result, 't', 'plv8 runs after a preload');
+
+$node->stop;
+
+done_testing();